@@ -7,23 +7,45 @@ Copyright (C) 2011 Rodrigo Rivas Costa <rodrigorivascosta@gmail.com>
 #include "config.h"
 #include <lirc/lirc_client.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <locale.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <getopt.h>
 #include <time.h>
 
 #include <regex.h>
+#include <langinfo.h>
+#include <mntent.h>
 #include <wordexp.h>
 
 #include <string>
 #include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <set>
 #include <iostream>
+#include <iomanip>
 #include <algorithm>
+#include <bitset>
 
 #include <gdk/gdkx.h>
 #include "miglib/migtk.h"
@@ -43,7 +65,7 @@ public:
     {
         m_dir = opendir(name);
     }
-    OpenDir(std::string &name)
+    OpenDir(const std::string &name)
     {
         m_dir = opendir(name.c_str());
     }
@@ -63,6 +85,299 @@ private:
     DIR *m_dir;
 };
 
+//Opens for readdir() the directory fd, that is still owned by the caller, NULL on error.
+//Both share the file offset, so fd is only for the *at() calls while it is read.
+static DIR *OpenDirFd(int fd)
+{
+    int fd2 = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd2 == -1)
+        return NULL;
+    DIR *dir = fdopendir(fd2);
+    if (!dir)
+        close(fd2);
+    return dir;
+}
+
+//One of the DT_* constants, maybe DT_UNKNOWN
+static inline unsigned char DirentType(const dirent *entry)
+{
+#ifdef _DIRENT_HAVE_D_TYPE
+    return entry->d_type;
+#else
+    return DT_UNKNOWN;
+#endif
+}
+
+class OpenFd
+{
+public:
+    explicit OpenFd(int fd=-1)
+        :m_fd(fd)
+    {}
+    ~OpenFd()
+    {
+        Reset();
+    }
+    void Reset(int fd=-1)
+    {
+        if (m_fd != -1)
+            close(m_fd);
+        m_fd = fd;
+    }
+    operator int() const
+    { return m_fd; }
+private:
+    int m_fd;
+    OpenFd(const OpenFd &); //nocopy
+    void operator=(const OpenFd &); //nocopy
+};
+
+//The metadata of a directory entry
+struct EntryStat
+{
+    bool ok; //false if it could not be stat'ed
+    mode_t mode;
+    time_t mtime;
+    uint64_t size;
+
+    EntryStat()
+        :ok(false), mode(0), mtime(0), size(0)
+    {}
+};
+
+//StatBatch gets the metadata of many entries of a directory, relative to its fd.
+//If io_uring is available all the statx() calls are submitted at once, so they run in
+//parallel and the latency of a network filesystem is paid once per batch instead of once
+//per entry. Otherwise, or if it fails, they are done one by one with fstatat().
+class StatBatch
+{
+public:
+    //Callers should Run() the batch when it has this many entries
+    enum { MAX_BATCH = 4096 };
+
+    StatBatch(int dirFd);
+    ~StatBatch();
+    void Add(const char *name, ino_t ino); //the name is copied
+    size_t Size() const
+    { return m_offsets.size(); }
+    const char *Name(size_t i) const
+    { return &m_names[m_offsets[i]]; }
+    ino_t Inode(size_t i) const
+    { return m_inodes[i]; }
+    //Valid after Run()
+    const EntryStat &Stat(size_t i) const
+    { return m_results[i]; }
+    void Run();
+    void Clear();
+
+#ifdef RCLAUNCHER_BENCHMARK
+    static void EnableIoUring(bool enable);
+#endif
+private:
+    int m_dirFd;
+    std::vector<char> m_names;
+    std::vector<size_t> m_offsets;
+    std::vector<ino_t> m_inodes;
+    std::vector<EntryStat> m_results;
+    std::vector<char> m_done;
+#ifdef HAVE_LIBURING
+    enum { QUEUE_DEPTH = 256, MIN_BATCH = 8 };
+    static volatile gint s_ioUring;
+    bool m_ringInit;
+    struct io_uring m_ring;
+    //The kernel writes to these buffers, so they must not move nor go while a request is in flight
+    std::vector<struct statx> m_statx;
+    bool RunIoUring();
+    void DropRing(size_t inFlight);
+#endif
+    void RunSync();
+
+    StatBatch(const StatBatch &); //nocopy
+    void operator=(const StatBatch &); //nocopy
+};
+
+#ifdef HAVE_LIBURING
+volatile gint StatBatch::s_ioUring = 1;
+#endif
+
+StatBatch::StatBatch(int dirFd)
+    :m_dirFd(dirFd)
+#ifdef HAVE_LIBURING
+    , m_ringInit(false)
+#endif
+{
+}
+
+StatBatch::~StatBatch()
+{
+#ifdef HAVE_LIBURING
+    if (m_ringInit)
+        io_uring_queue_exit(&m_ring);
+#endif
+}
+
+void StatBatch::Add(const char *name, ino_t ino)
+{
+    m_offsets.push_back(m_names.size());
+    m_inodes.push_back(ino);
+    m_names.insert(m_names.end(), name, name + strlen(name) + 1);
+}
+
+void StatBatch::Clear()
+{
+    m_names.clear();
+    m_offsets.clear();
+    m_inodes.clear();
+    m_results.clear();
+    m_done.clear();
+}
+
+#ifdef RCLAUNCHER_BENCHMARK
+/*static*/void StatBatch::EnableIoUring(bool enable)
+{
+#ifdef HAVE_LIBURING
+    g_atomic_int_set(&s_ioUring, enable);
+#endif
+}
+#endif
+
+void StatBatch::Run()
+{
+    m_results.assign(Size(), EntryStat());
+    m_done.assign(Size(), false);
+#ifdef HAVE_LIBURING
+    if (Size() >= MIN_BATCH)
+        RunIoUring();
+#endif
+    //Whatever is left
+    RunSync();
+}
+
+void StatBatch::RunSync()
+{
+    for (size_t i = 0; i < Size(); ++i)
+    {
+        if (m_done[i])
+            continue;
+        struct stat st;
+        if (fstatat(m_dirFd, Name(i), &st, 0) == 0)
+        {
+            m_results[i].ok = true;
+            m_results[i].mode = st.st_mode;
+            m_results[i].mtime = st.st_mtime;
+            m_results[i].size = st.st_size;
+        }
+        m_done[i] = true;
+    }
+}
+
+#ifdef HAVE_LIBURING
+bool StatBatch::RunIoUring()
+{
+    if (!g_atomic_int_get(&s_ioUring))
+        return false;
+    if (!m_ringInit)
+    {
+        if (io_uring_queue_init(QUEUE_DEPTH, &m_ring, 0) < 0)
+        {
+            //Not supported by the kernel, or forbidden: do not try again
+            g_atomic_int_set(&s_ioUring, 0);
+            return false;
+        }
+        m_ringInit = true;
+    }
+
+    m_statx.resize(Size());
+    size_t next = 0, inFlight = 0;
+    bool ok = true;
+    for (;;)
+    {
+        //Keep the ring full
+        size_t queued = 0;
+        while (ok && next < Size())
+        {
+            io_uring_sqe *sqe = io_uring_get_sqe(&m_ring);
+            if (!sqe)
+                break;
+            io_uring_prep_statx(sqe, m_dirFd, Name(next), 0, STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_SIZE, &m_statx[next]);
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<uintptr_t>(next)));
+            ++next;
+            ++queued;
+        }
+        if (queued > 0)
+        {
+            int res = io_uring_submit(&m_ring);
+            if (res < 0)
+                ok = false;
+            else
+                inFlight += res;
+        }
+        if (inFlight == 0)
+            break;
+
+        io_uring_cqe *cqe;
+        int res;
+        while ((res = io_uring_wait_cqe(&m_ring, &cqe)) == -EINTR)
+            ;
+        if (res < 0)
+        {
+            //This should not happen
+            ok = false;
+            break;
+        }
+        do
+        {
+            size_t i = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe));
+            if (cqe->res == 0)
+            {
+                m_results[i].ok = true;
+                m_results[i].mode = m_statx[i].stx_mode;
+                m_results[i].mtime = m_statx[i].stx_mtime.tv_sec;
+                m_results[i].size = m_statx[i].stx_size;
+                m_done[i] = true;
+            }
+            else if (cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP)
+            {
+                //A real error, such as ENOENT
+                m_done[i] = true;
+            }
+            //else the kernel does not support statx in io_uring, RunSync() will do it
+            io_uring_cqe_seen(&m_ring, cqe);
+            --inFlight;
+        } while (inFlight > 0 && io_uring_peek_cqe(&m_ring, &cqe) == 0);
+    }
+    if (!ok)
+        DropRing(inFlight);
+    return ok;
+}
+
+//Gives up on the ring, the rest is done synchronously and no one will use io_uring again.
+//The requests still in flight are waited for, as they write to m_statx. If even that fails,
+//the ring and the buffers are left alone, and leaked, rather than freed under the kernel.
+void StatBatch::DropRing(size_t inFlight)
+{
+    g_atomic_int_set(&s_ioUring, 0);
+    m_ringInit = false;
+    while (inFlight > 0)
+    {
+        io_uring_cqe *cqe;
+        int res = io_uring_wait_cqe(&m_ring, &cqe);
+        if (res == -EINTR)
+            continue;
+        if (res < 0)
+        {
+            std::vector<struct statx> *busy = new std::vector<struct statx>;
+            busy->swap(m_statx);
+            return;
+        }
+        //Not m_done, so RunSync() does it again
+        io_uring_cqe_seen(&m_ring, cqe);
+        --inFlight;
+    }
+    io_uring_queue_exit(&m_ring);
+}
+#endif
+
 std::string BaseName(const std::string &file)
 {
     if (file == "/")
@@ -94,6 +409,20 @@ using namespace miglib;
 bool g_verbose = false;
 bool g_fullscreen = true;
 bool g_hideOnRun = false;
+
+#ifdef RCLAUNCHER_BENCHMARK
+//Read the directories by path and stat() the entries by their full path, the old way,
+//kept for comparison.
+bool g_statByPath = false;
+//Always stat() the entries, as if the filesystem did not provide d_type.
+bool g_ignoreDType = false;
+//Classify the entries of big directories in several threads.
+bool g_parallelClassify = true;
+#else
+//Only the benchmark changes these
+const bool g_ignoreDType = false;
+const bool g_parallelClassify = true;
+#endif
 std::string g_geometry;
 
 struct ILircClient
@@ -184,894 +513,6056 @@ void RegEx::Throw(int res, const std::string &txt)
 struct FileAssoc
 {
     RegEx regex;
+    //The source of regex, for the AssocMatcher
+    std::string pattern;
+    int cflags;
+    //For an <extension>, the ext attribute
+    std::string ext;
     std::vector<std::string> args;
     bool isKillable;
 
-    FileAssoc(const char *re, int cflags)
-        :regex(re, cflags), isKillable(false)
+    FileAssoc(const char *re, int cf)
+        :regex(re, cf), pattern(re), cflags(cf), isKillable(false)
     {
     }
-    static FileAssoc *Match(const std::vector<FileAssoc*> &assocs, const std::string &file);
-    static FileAssoc *MatchGlobal(const std::string &file);
+    static FileAssoc *Match(const std::vector<FileAssoc*> &assocs, const char *file);
+    static FileAssoc *MatchGlobal(const char *file);
 };
 
-struct NameTrans
+//AssocMatcher compiles the patterns of a list of associations into a single automaton
+//that finds the first association matching a file name in one scan of the name.
+//The plain <extension> associations are not in the automaton but in a hash table.
+//It understands the usual subset of the extended regexes: literals, '.', brackets, groups,
+//alternatives, repetitions and anchors. The patterns with anything else (character classes,
+//GNU escapes, non-ASCII characters...) are still checked with regexec(), in their turn.
+class AssocMatcher
 {
-    RegEx regex;
-    bool global;
-    std::string to;
-
-    NameTrans(const char *sfrom, int cflags, bool cglobal, const char *sto)
-        :regex(sfrom, cflags), global(cglobal), to(sto)
+public:
+    AssocMatcher()
+        :m_ready(false), m_exts(NULL), m_nClasses(0), m_acceptEmpty(0)
+    {}
+    ~AssocMatcher()
     {
+        if (m_exts)
+            g_hash_table_destroy(m_exts);
     }
-    std::string TransformName(const std::string &name) const;
+    //assocs must not have NULLs
+    void Compile(const std::vector<FileAssoc*> &assocs);
+    bool IsReady() const
+    { return m_ready; }
+    //The number of associations in the automaton or the hash table, the others use regexec()
+    size_t Compiled() const
+    { return m_assocs.size() - m_fallback.size(); }
+    size_t Extensions() const
+    { return m_exts? g_hash_table_size(m_exts) : 0; }
+    size_t States() const
+    { return m_acceptNow.size(); }
+    FileAssoc *Match(const char *file) const;
+private:
+    //If the automaton grows beyond these, the remaining patterns use regexec()
+    enum { MAX_NFA_STATES = 20000, MAX_DFA_STATES = 4096, MAX_REPEAT = 64, MAX_EXT = 32 };
+    typedef std::bitset<256> ByteSet;
 
-    static std::string TransformName(const std::vector<NameTrans*> &trans, const std::string &name);
-    static std::string TransformNameGlobal(const std::string &name);
+    //Parse tree of a pattern
+    enum NodeType { N_EMPTY, N_SET, N_CHAR, N_CAT, N_ALT, N_REPEAT, N_BOL, N_EOL };
+    struct Node
+    {
+        NodeType type;
+        //N_SET: a byte of m_sets[set]
+        //N_CHAR: in an UTF-8 locale, a whole character: a single byte one of m_sets[set] or any multibyte one
+        int set;
+        int min, max; //N_REPEAT, max -1 means unbounded
+        std::vector<int> kids;
+    };
+    struct Unsupported {};
+    struct Parser;
+
+    //The NFA, built from the end of each pattern backwards
+    enum StateType { S_SET, S_SPLIT, S_BOL, S_EOL, S_ACCEPT };
+    struct NfaState
+    {
+        StateType type;
+        int set, next; //S_SET: the byte set; S_SET, S_BOL, S_EOL: the next state
+        std::vector<int> split;
+        unsigned assoc; //S_ACCEPT: the index of the association
+    };
+
+    bool m_ready;
+    std::vector<FileAssoc*> m_assocs;
+    std::vector<unsigned> m_fallback;
+    //The lowercase extension to the index of the first association with it, plus 1
+    GHashTable *m_exts;
+    std::vector<ByteSet> m_sets;
+    std::vector<NfaState> m_nfa;
+    std::vector<int> m_starts;
+    int m_utf8Sets[4]; //continuation, 2, 3 and 4 byte lead bytes
+
+    //The DFA: a table of states by classes of equivalent bytes.
+    //m_acceptNow is the first association that matches up to here and m_acceptEnd
+    //the first one if the name ends here; m_assocs.size() if none.
+    int m_nClasses;
+    int m_classOf[256];
+    std::vector<int> m_trans;
+    std::vector<unsigned> m_acceptNow, m_acceptEnd;
+    unsigned m_acceptEmpty; //for an empty name, where both '^' and '$' hold
+
+    int NewState(StateType type, int set, int next, unsigned assoc);
+    int Emit(const std::vector<Node> &nodes, int n, int next, unsigned assoc);
+    void Closure(std::vector<int> &states, bool bol, bool eol) const;
+    unsigned FirstAccept(const std::vector<int> &states) const;
+    bool BuildDfa();
+    static bool IsPlainExtension(const FileAssoc *assoc);
+
+    AssocMatcher(const AssocMatcher &); //nocopy
+    void operator=(const AssocMatcher &); //nocopy
 };
 
-std::string NameTrans::TransformName(const std::string &name) const
+struct AssocMatcher::Parser
 {
-    regmatch_t matches[10];
-    std::string res;
-    size_t start = 0, last = 0;
-    bool prevEmpty = true;
-    do
+    const std::string &re;
+    size_t pos;
+    bool icase, utf8;
+    std::vector<Node> &nodes;
+    std::vector<ByteSet> &sets;
+
+    Parser(const std::string &r, bool ic, bool u, std::vector<Node> &n, std::vector<ByteSet> &s)
+        :re(r), pos(0), icase(ic), utf8(u), nodes(n), sets(s)
+    {}
+    int Parse()
     {
-        int nres = regexec(regex, name.c_str() + start, sizeof(matches) / sizeof(*matches), matches, start? REG_NOTBOL : 0);
-        if (nres != REG_NOERROR)
+        int root = ParseAlt();
+        if (pos != re.size())
+            throw Unsupported();
+        return root;
+    }
+private:
+    int Peek() const
+    { return pos < re.size()? static_cast<unsigned char>(re[pos]) : -1; }
+    int NewNode(NodeType type, int set = -1)
+    {
+        Node node;
+        node.type = type;
+        node.set = set;
+        node.min = node.max = 0;
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+    int NewSet(const ByteSet &set, bool isChar)
+    {
+        sets.push_back(set);
+        return NewNode(isChar && utf8? N_CHAR : N_SET, sets.size() - 1);
+    }
+    //Only ASCII, so that it does not depend on the locale
+    void AddChar(ByteSet &set, int ch) const
+    {
+        set.set(ch);
+        if (icase && ch >= 'a' && ch <= 'z')
+            set.set(ch - 'a' + 'A');
+        else if (icase && ch >= 'A' && ch <= 'Z')
+            set.set(ch - 'A' + 'a');
+    }
+    int ParseAlt()
+    {
+        int first = ParseCat();
+        if (Peek() != '|')
+            return first;
+        int alt = NewNode(N_ALT);
+        nodes[alt].kids.push_back(first);
+        while (Peek() == '|')
+        {
+            ++pos;
+            int kid = ParseCat();
+            nodes[alt].kids.push_back(kid);
+        }
+        return alt;
+    }
+    int ParseCat()
+    {
+        int cat = NewNode(N_CAT);
+        while (Peek() != -1 && Peek() != '|' && Peek() != ')')
+        {
+            int atom = ParseAtom();
+            int min, max;
+            while (ParseRepeat(min, max))
+            {
+                if (nodes[atom].type == N_BOL || nodes[atom].type == N_EOL)
+                    throw Unsupported();
+                int rep = NewNode(N_REPEAT);
+                nodes[rep].min = min;
+                nodes[rep].max = max;
+                nodes[rep].kids.push_back(atom);
+                atom = rep;
+            }
+            nodes[cat].kids.push_back(atom);
+        }
+        return cat;
+    }
+    bool ParseRepeat(int &min, int &max)
+    {
+        switch (Peek())
+        {
+        case '*':
+            min = 0; max = -1;
             break;
-        if (!(matches[0].rm_eo == 0 && !prevEmpty))
-        { //Do not replace empty matches if the previous one was non-empty
-            res += name.substr(start, matches[0].rm_so);
-            size_t pos = 0;
-            for (;;)
+        case '+':
+            min = 1; max = -1;
+            break;
+        case '?':
+            min = 0; max = 1;
+            break;
+        case '{':
+            ++pos;
+            min = ParseNumber(0);
+            max = min;
+            if (Peek() == ',')
             {
-                size_t pos2 = to.find('\\', pos);
-                if (pos2 != std::string::npos)
-                {
-                    res += to.substr(pos, pos2 - pos);
-                    if (pos2 + 1 < to.size())
-                    {
-                        char ch = to[pos2 + 1];
-                        if (ch >= '0' && ch <= '9')
-                        {
-                            int idx = ch - '0';
-                            if (matches[idx].rm_so != -1)
-                                res += name.substr(start + matches[idx].rm_so, matches[idx].rm_eo - matches[idx].rm_so);
-                        }
-                        else
-                            res += ch;
-                    }
-                    else
-                    {
-                        res += '\\';
-                        break;
-                    }
-                }
-                else
-                {
-                    res += to.substr(pos);
-                    break;
-                }
-                pos = pos2 + 2;
+                ++pos;
+                max = ParseNumber(-1);
             }
+            if (Peek() != '}' || (max != -1 && max < min) || max > MAX_REPEAT || min > MAX_REPEAT)
+                throw Unsupported();
+            break;
+        default:
+            return false;
         }
-        if (matches[0].rm_eo > 0)
+        ++pos;
+        return true;
+    }
+    int ParseNumber(int def)
+    {
+        if (Peek() < '0' || Peek() > '9')
+            return def;
+        int n = 0;
+        while (Peek() >= '0' && Peek() <= '9' && n <= MAX_REPEAT)
+            n = n * 10 + (re[pos++] - '0');
+        return n;
+    }
+    int ParseAtom()
+    {
+        int ch = Peek();
+        ++pos;
+        switch (ch)
         {
-            start += matches[0].rm_eo;
-            prevEmpty = false;
+        case '(':
+            {
+                int group = ParseAlt();
+                if (Peek() != ')')
+                    throw Unsupported();
+                ++pos;
+                return group;
+            }
+        case '^':
+            return NewNode(N_BOL);
+        case '$':
+            return NewNode(N_EOL);
+        case '.':
+            {
+                ByteSet set;
+                set.set();
+                if (utf8)
+                    set >>= 128;
+                return NewSet(set, true);
+            }
+        case '[':
+            return ParseBracket();
+        case '\\':
+            ch = Peek();
+            ++pos;
+            //The GNU extensions and the back-references
+            if (ch == -1 || isalnum(ch))
+                throw Unsupported();
+            break;
+        case '*': case '+': case '?': case '{':
+            throw Unsupported();
         }
-        else
-        { //If an empty match is found advance just one char or else we'll get stuck in an infinite loop
-            res += name[start];
-            start += 1;
-            prevEmpty = true;
+        if (ch >= 0x80)
+            throw Unsupported();
+        ByteSet set;
+        AddChar(set, ch);
+        return NewSet(set, false);
+    }
+    int ParseBracket()
+    {
+        ByteSet set;
+        bool negate = Peek() == '^';
+        if (negate)
+            ++pos;
+        for (bool first = true; ; first = false)
+        {
+            int lo = Peek();
+            ++pos;
+            if (lo == -1 || lo >= 0x80)
+                throw Unsupported();
+            if (lo == ']' && !first)
+                break;
+            //Character classes, equivalence classes and collating symbols
+            if (lo == '[' && (Peek() == ':' || Peek() == '=' || Peek() == '.'))
+                throw Unsupported();
+            int hi = lo;
+            if (Peek() == '-' && pos + 1 < re.size() && re[pos + 1] != ']')
+            {
+                hi = static_cast<unsigned char>(re[pos + 1]);
+                pos += 2;
+                if (hi >= 0x80 || hi < lo || (hi == '[' && (Peek() == ':' || Peek() == '=' || Peek() == '.')))
+                    throw Unsupported();
+            }
+            for (int ch = lo; ch <= hi; ++ch)
+                AddChar(set, ch);
         }
-        last = start;
-    } while (global && start <= name.size());
-    if (last < name.size())
-        res += name.substr(last);
-    return res;
+        if (negate)
+        {
+            set.flip();
+            if (utf8)
+            {
+                set <<= 128;
+                set >>= 128;
+            }
+        }
+        return NewSet(set, negate);
+    }
+};
+
+int AssocMatcher::NewState(StateType type, int set, int next, unsigned assoc)
+{
+    if (m_nfa.size() >= MAX_NFA_STATES)
+        throw Unsupported();
+    NfaState st;
+    st.type = type;
+    st.set = set;
+    st.next = next;
+    st.assoc = assoc;
+    m_nfa.push_back(st);
+    return m_nfa.size() - 1;
 }
 
-struct DirEntry
+//Returns the first state of nodes[n], that continues to next
+int AssocMatcher::Emit(const std::vector<Node> &nodes, int n, int next, unsigned assoc)
 {
-    //dispName is the name shown to the user
-    //fileName is a lister-specific text to be used by Lister::ActualFile() to build the real file name
-    std::string dispName, fileName;
-    bool isDir;
-    FileAssoc *assoc;
-    DirEntry(const std::string &disp, const std::string &file, FileAssoc *fa, bool d)
-        :dispName(disp), fileName(file), isDir(d), assoc(fa)
+    const Node &node = nodes[n];
+    switch (node.type)
     {
-        //assert((fa == NULL) == isDir); //assoc is NULL iff !isDir
+    case N_EMPTY:
+        return next;
+    case N_SET:
+        return NewState(S_SET, node.set, next, assoc);
+    case N_CHAR:
+        {
+            std::vector<int> split;
+            split.push_back(NewState(S_SET, node.set, next, assoc));
+            int cont = next;
+            for (int i = 1; i < 4; ++i)
+            {
+                cont = NewState(S_SET, m_utf8Sets[0], cont, assoc);
+                split.push_back(NewState(S_SET, m_utf8Sets[i], cont, assoc));
+            }
+            int alt = NewState(S_SPLIT, -1, -1, assoc);
+            m_nfa[alt].split.swap(split);
+            return alt;
+        }
+    case N_CAT:
+        for (size_t i = node.kids.size(); i-- > 0; )
+            next = Emit(nodes, node.kids[i], next, assoc);
+        return next;
+    case N_ALT:
+        {
+            std::vector<int> split;
+            for (size_t i = 0; i < node.kids.size(); ++i)
+                split.push_back(Emit(nodes, node.kids[i], next, assoc));
+            int alt = NewState(S_SPLIT, -1, -1, assoc);
+            m_nfa[alt].split.swap(split);
+            return alt;
+        }
+    case N_REPEAT:
+        {
+            int cur = next;
+            if (node.max < 0)
+            {
+                int loop = NewState(S_SPLIT, -1, -1, assoc);
+                int body = Emit(nodes, node.kids[0], loop, assoc);
+                m_nfa[loop].split.push_back(body);
+                m_nfa[loop].split.push_back(next);
+                cur = loop;
+            }
+            else
+            {
+                //x{0,2} is (x(x)?)?
+                for (int i = node.min; i < node.max; ++i)
+                {
+                    int body = Emit(nodes, node.kids[0], cur, assoc);
+                    cur = NewState(S_SPLIT, -1, -1, assoc);
+                    m_nfa[cur].split.push_back(body);
+                    m_nfa[cur].split.push_back(next);
+                }
+            }
+            for (int i = 0; i < node.min; ++i)
+                cur = Emit(nodes, node.kids[0], cur, assoc);
+            return cur;
+        }
+    case N_BOL:
+        return NewState(S_BOL, -1, next, assoc);
+    case N_EOL:
+        return NewState(S_EOL, -1, next, assoc);
     }
-    bool operator < (const DirEntry &o) const
+    return next;
+}
+
+void AssocMatcher::Compile(const std::vector<FileAssoc*> &assocs)
+{
+    m_ready = true;
+    m_assocs = assocs;
+    m_fallback.clear();
+    m_sets.clear();
+    m_nfa.clear();
+    m_starts.clear();
+    m_trans.clear();
+    m_acceptNow.clear();
+    m_acceptEnd.clear();
+    if (m_exts)
+        g_hash_table_destroy(m_exts);
+    m_exts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    //In an UTF-8 locale '.' matches a whole character. Other multibyte encodings are not supported.
+    bool utf8 = MB_CUR_MAX > 1;
+    bool supported = !utf8 || strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+    static const int utf8Ranges[4][2] = { {0x80, 0xBF}, {0xC2, 0xDF}, {0xE0, 0xEF}, {0xF0, 0xF4} };
+    for (int i = 0; i < 4; ++i)
     {
-        //First of all the directories
-        if (isDir && !o.isDir)
-            return true;
-        if (!isDir && o.isDir)
-            return false;
-        //And the top directory is always "..", if present.
-        bool p1 = dispName == "..", p2 = o.dispName == "..";
-        if (p1 && !p2)
-            return true;
-        if (!p1 && p2)
-            return false;
-        //Then use collation order
-        int r = strcoll(dispName.c_str(), o.dispName.c_str());
-        return r < 0;
+        ByteSet set;
+        for (int ch = utf8Ranges[i][0]; ch <= utf8Ranges[i][1]; ++ch)
+            set.set(ch);
+        m_utf8Sets[i] = m_sets.size();
+        m_sets.push_back(set);
     }
-};
 
-class Lister
-{
-public:
-    Lister(int id)
-        :m_id(id)
-    {}
-    virtual ~Lister()
+    for (unsigned i = 0; i < m_assocs.size(); ++i)
     {
-        for (size_t i = 0; i < m_assocs.size(); ++i)
-            delete m_assocs[i];
-        for (size_t i = 0; i < m_nameTrans.size(); ++i)
-            delete m_nameTrans[i];
+        const FileAssoc *assoc = m_assocs[i];
+        if (IsPlainExtension(assoc))
+        {
+            gchar *ext = g_ascii_strdown(assoc->ext.c_str(), -1);
+            if (!g_hash_table_lookup(m_exts, ext))
+                g_hash_table_insert(m_exts, ext, GUINT_TO_POINTER(i + 1));
+            else
+                g_free(ext);
+            continue;
+        }
+        size_t nSets = m_sets.size(), nStates = m_nfa.size();
+        try
+        {
+            if (!supported || !(assoc->cflags & REG_EXTENDED) || (assoc->cflags & REG_NEWLINE))
+                throw Unsupported();
+            std::vector<Node> nodes;
+            int root = Parser(assoc->pattern, assoc->cflags & REG_ICASE, utf8, nodes, m_sets).Parse();
+            int accept = NewState(S_ACCEPT, -1, -1, i);
+            m_starts.push_back(Emit(nodes, root, accept, i));
+        }
+        catch (Unsupported &)
+        {
+            m_sets.resize(nSets);
+            m_nfa.resize(nStates);
+            m_fallback.push_back(i);
+        }
     }
-    void AddAssoc(FileAssoc *fa)
+    //If the DFA is too big, the last patterns are left out until it fits
+    while (!m_starts.empty() && !BuildDfa())
     {
-        m_assocs.push_back(fa);
+        m_trans.clear();
+        m_acceptNow.clear();
+        m_acceptEnd.clear();
+        unsigned last = m_nfa[m_starts.back()].assoc;
+        m_starts.pop_back();
+        m_fallback.insert(std::upper_bound(m_fallback.begin(), m_fallback.end(), last), last);
     }
-    void AddDefaultAssoc()
+    //Not needed any more
+    std::vector<ByteSet>().swap(m_sets);
+    std::vector<NfaState>().swap(m_nfa);
+    std::vector<int>().swap(m_starts);
+}
+
+//The regex of an <extension> is "\\.ext$". Without any special char in ext, and case
+//insensitive, it is the same as comparing ext with what follows the last dot of the name.
+/*static*/bool AssocMatcher::IsPlainExtension(const FileAssoc *assoc)
+{
+    if (assoc->ext.empty() || assoc->ext.size() > MAX_EXT || !(assoc->cflags & REG_ICASE))
+        return false;
+    for (size_t i = 0; i < assoc->ext.size(); ++i)
     {
-        m_assocs.push_back(NULL);
+        char ch = assoc->ext[i];
+        if (!g_ascii_isalnum(ch) && ch != '_' && ch != '-' && ch != '~')
+            return false;
     }
-    void AddNameTransform(NameTrans *nt)
+    return true;
+}
+
+//Replaces states with the states reachable from them without reading a byte.
+//Only those that read a byte, accept, or check the end (unless eol) are kept.
+void AssocMatcher::Closure(std::vector<int> &states, bool bol, bool eol) const
+{
+    std::vector<int> stack;
+    stack.swap(states);
+    std::vector<bool> visited(m_nfa.size());
+    while (!stack.empty())
     {
-        m_nameTrans.push_back(nt);
+        int s = stack.back();
+        stack.pop_back();
+        if (visited[s])
+            continue;
+        visited[s] = true;
+        const NfaState &st = m_nfa[s];
+        switch (st.type)
+        {
+        case S_SPLIT:
+            stack.insert(stack.end(), st.split.begin(), st.split.end());
+            break;
+        case S_BOL:
+            if (bol)
+                stack.push_back(st.next);
+            break;
+        case S_EOL:
+            if (eol)
+                stack.push_back(st.next);
+            else
+                states.push_back(s);
+            break;
+        default:
+            states.push_back(s);
+            break;
+        }
     }
-    int Id()
-    { return m_id; }
-
-    virtual std::string Title() =0;
-    virtual std::string Root() =0;
-    virtual void ChangePath(const DirEntry &entry) =0;
-    virtual void ChangePath(const std::string &path) =0;
-    virtual bool Back(std::string &prev) =0; //returns false if going back from root directory
-    virtual void ListDir(std::vector<DirEntry> &files) =0;
-    virtual std::string ActualFile(const DirEntry &entry) =0;
+    std::sort(states.begin(), states.end());
+}
 
-    virtual FileAssoc *Match(const std::string &file)
+unsigned AssocMatcher::FirstAccept(const std::vector<int> &states) const
+{
+    unsigned first = m_assocs.size();
+    for (size_t i = 0; i < states.size(); ++i)
     {
-        return FileAssoc::Match(m_assocs, file);
+        const NfaState &st = m_nfa[states[i]];
+        if (st.type == S_ACCEPT && st.assoc < first)
+            first = st.assoc;
     }
+    return first;
+}
 
-    std::string TransformName(const std::string &name) const
+//Subset construction. Every step adds the first states of all the patterns again,
+//so that they match anywhere in the name, as regexec() does.
+bool AssocMatcher::BuildDfa()
+{
+    //The bytes that are in the same sets behave the same
+    std::map<std::vector<bool>, int> classes;
+    std::vector<int> classRep;
+    for (int ch = 0; ch < 256; ++ch)
     {
-        if (!m_nameTrans.empty())
-            return NameTrans::TransformName(m_nameTrans, name);
-        else
-            return NameTrans::TransformNameGlobal(name);
+        std::vector<bool> sig(m_sets.size());
+        for (size_t i = 0; i < m_sets.size(); ++i)
+            sig[i] = m_sets[i][ch];
+        std::map<std::vector<bool>, int>::iterator it = classes.find(sig);
+        if (it == classes.end())
+        {
+            it = classes.insert(std::make_pair(sig, static_cast<int>(classRep.size()))).first;
+            classRep.push_back(ch);
+        }
+        m_classOf[ch] = it->second;
     }
+    m_nClasses = classRep.size();
+
+    std::map<std::vector<int>, int> ids;
+    std::vector<std::vector<int> > dstates;
+    std::vector<int> states(m_starts);
+    Closure(states, true, true);
+    m_acceptEmpty = FirstAccept(states);
+    states = m_starts;
+    Closure(states, true, false);
+    ids[states] = 0;
+    dstates.push_back(states);
+    for (size_t d = 0; d < dstates.size(); ++d)
+    {
+        //A copy, dstates grows in the loop
+        std::vector<int> cur = dstates[d];
+        m_acceptNow.push_back(FirstAccept(cur));
+        std::vector<int> end(cur);
+        Closure(end, false, true);
+        m_acceptEnd.push_back(FirstAccept(end));
+
+        m_trans.resize(dstates.size() * m_nClasses);
+        for (int c = 0; c < m_nClasses; ++c)
+        {
+            states = m_starts;
+            for (size_t i = 0; i < cur.size(); ++i)
+            {
+                const NfaState &st = m_nfa[cur[i]];
+                if (st.type == S_SET && m_sets[st.set][classRep[c]])
+                    states.push_back(st.next);
+            }
+            Closure(states, false, false);
+            std::map<std::vector<int>, int>::iterator it = ids.find(states);
+            if (it == ids.end())
+            {
+                if (dstates.size() >= MAX_DFA_STATES)
+                    return false;
+                it = ids.insert(std::make_pair(states, static_cast<int>(dstates.size()))).first;
+                dstates.push_back(states);
+            }
+            m_trans[d * m_nClasses + c] = it->second;
+        }
+    }
+    return true;
+}
 
-private:
-    int m_id;
-    //Smart hack: A NULL value in the m_assocs vector means to search into MatchGlobal recursively.
-    std::vector<FileAssoc*> m_assocs;
-    std::vector<NameTrans*> m_nameTrans;
-    
-};
-
-class FileLister : public Lister
+FileAssoc *AssocMatcher::Match(const char *file) const
 {
-public:
-    FileLister(int id, const std::string &title, const std::string &root)
-        :Lister(id), m_title(title), m_root(root), m_cwd("/")
-    {}
-
-    std::string Title()
+    unsigned first = m_assocs.size();
+    const char *dot = strrchr(file, '.');
+    if (dot && m_exts)
     {
-        std::string res = m_title;
-        if (!res.empty())
-           res += ": ";
-        res += m_cwd;
-        return res;
+        char ext[MAX_EXT + 1];
+        size_t len = 0;
+        for (const char *p = dot + 1; *p && len <= MAX_EXT; ++p)
+            ext[len++] = g_ascii_tolower(*p);
+        if (len <= MAX_EXT)
+        {
+            ext[len] = 0;
+            first = GPOINTER_TO_UINT(g_hash_table_lookup(m_exts, ext));
+            first = first? first - 1 : m_assocs.size();
+        }
     }
-    std::string Root()
-    { return m_root; }
-    virtual void ChangePath(const DirEntry &entry);
-    virtual void ChangePath(const std::string &path);
-    virtual bool Back(std::string &prev);
-    virtual void ListDir(std::vector<DirEntry> &files);
-    virtual std::string ActualFile(const DirEntry &entry)
+    if (!m_acceptNow.empty())
     {
-        std::string fullPath = m_cwd;
-        if (fullPath != "/")
-            fullPath += "/";
-        fullPath += entry.fileName;
-        return m_root + fullPath;
+        int s = 0;
+        if (!*file && m_acceptEmpty < first)
+            first = m_acceptEmpty;
+        if (m_acceptNow[0] < first)
+            first = m_acceptNow[0];
+        for (const unsigned char *p = reinterpret_cast<const unsigned char*>(file); *p; ++p)
+        {
+            s = m_trans[s * m_nClasses + m_classOf[*p]];
+            if (m_acceptNow[s] < first)
+                first = m_acceptNow[s];
+        }
+        if (m_acceptEnd[s] < first)
+            first = m_acceptEnd[s];
+    }
+    //The patterns that are not in the automaton, if they come before
+    for (size_t i = 0; i < m_fallback.size() && m_fallback[i] < first; ++i)
+    {
+        FileAssoc *assoc = m_assocs[m_fallback[i]];
+        if (regexec(assoc->regex, file, 0, NULL, 0) == REG_NOERROR)
+            return assoc;
+    }
+    return first < m_assocs.size()? m_assocs[first] : NULL;
+}
+
+struct NameTrans
+{
+    RegEx regex;
+    bool global;
+    //If every transformation of a chain has this, the entries are sorted by their file name, so
+    //the transformed names are computed only when they are displayed. If not, they are used to
+    //sort the entries, so they are computed while listing, for the names that the chain changes.
+    bool displayOnly;
+    std::string to;
+
+    NameTrans(const char *sfrom, int cflags, bool cglobal, bool cdisplayOnly, const char *sto)
+        :regex(sfrom, cflags), global(cglobal), displayOnly(cdisplayOnly), to(sto)
+    {
+        ParseTemplate(to);
     }
+    void TransformName(const std::string &name, std::string &res) const;
+
+    //The stages before first must not match name, see FirstChange()
+    static void TransformName(const std::vector<NameTrans*> &trans, const std::string &name, std::string &res, size_t first = 0);
+    static std::string TransformName(const std::vector<NameTrans*> &trans, const std::string &name);
+    static std::string TransformNameGlobal(const std::string &name);
+    static const std::vector<NameTrans*> &Global();
+    static bool AffectsSort(const std::vector<NameTrans*> &trans);
+    //The first transformation of the chain that matches name, trans.size() if none does,
+    //so that it would be left as it is
+    static size_t FirstChange(const std::vector<NameTrans*> &trans, const char *name);
 private:
-    std::string m_title, m_root;
-    std::string m_cwd; //relative to m_root
-};
+    //A piece of the replacement: a literal from m_literals or a group of the match
+    struct Segment
+    {
+        int group; //-1 for a literal
+        size_t pos, len;
+    };
+    std::vector<Segment> m_segments;
+    std::string m_literals;
 
-FileLister g_defaultLister(0, "", "/");
+    void ParseTemplate(const std::string &tpl);
+    void AddLiteral(std::string &literal);
+};
 
-void FileLister::ChangePath(const DirEntry &entry)
-{
-    if (m_cwd == "/")
-        m_cwd.clear(); //to avoid the double /
-    m_cwd = m_cwd + "/" + entry.fileName;
-}
-void FileLister::ChangePath(const std::string &path)
+//Splits the replacement template into literals and references to the groups, so it
+//is not parsed again for every match
+void NameTrans::ParseTemplate(const std::string &tpl)
 {
-    m_cwd = path;
+    std::string literal;
+    for (size_t pos = 0; pos < tpl.size(); ++pos)
+    {
+        char ch = tpl[pos];
+        if (ch != '\\')
+        {
+            literal += ch;
+            continue;
+        }
+        if (pos + 1 == tpl.size())
+        {
+            literal += '\\';
+            break;
+        }
+        ch = tpl[++pos];
+        if (ch >= '0' && ch <= '9')
+        {
+            AddLiteral(literal);
+            Segment seg = { ch - '0', 0, 0 };
+            m_segments.push_back(seg);
+        }
+        else
+            literal += ch;
+    }
+    AddLiteral(literal);
 }
 
-bool FileLister::Back(std::string &prev)
+void NameTrans::AddLiteral(std::string &literal)
 {
-    if (m_cwd == "/")
-        return false;
-    prev = BaseName(m_cwd);
-    m_cwd = DirName(m_cwd);
-    return true;
+    if (literal.empty())
+        return;
+    Segment seg = { -1, m_literals.size(), literal.size() };
+    m_segments.push_back(seg);
+    m_literals += literal;
+    literal.clear();
 }
 
-void FileLister::ListDir(std::vector<DirEntry> &files)
+//res must not be name. It is overwritten, but its capacity is reused.
+void NameTrans::TransformName(const std::string &name, std::string &res) const
 {
-    std::string realPath = m_root + m_cwd;
-    if (realPath != "/" && realPath != "//")
-        files.push_back(DirEntry("..", "..", NULL, true));
-
-    OpenDir dir(realPath);
-    if (!dir)
-        return;
-
-    while (dirent *entry = readdir(dir))
+    regmatch_t matches[10];
+    const char *str = name.c_str();
+    res.clear();
+    size_t start = 0, last = 0;
+    bool prevEmpty = true;
+    do
     {
-        enum { T_Other, T_Dir, T_File } type = T_Other;
-#ifdef _DIRENT_HAVE_D_TYPE
-        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+        int nres = regexec(regex, str + start, sizeof(matches) / sizeof(*matches), matches, start? REG_NOTBOL : 0);
+        if (nres != REG_NOERROR)
+            break;
+        if (!(matches[0].rm_eo == 0 && !prevEmpty))
+        { //Do not replace empty matches if the previous one was non-empty
+            res.append(str + start, matches[0].rm_so);
+            for (size_t i = 0; i < m_segments.size(); ++i)
+            {
+                const Segment &seg = m_segments[i];
+                if (seg.group < 0)
+                    res.append(m_literals, seg.pos, seg.len);
+                else if (matches[seg.group].rm_so != -1)
+                    res.append(str + start + matches[seg.group].rm_so, matches[seg.group].rm_eo - matches[seg.group].rm_so);
+            }
+        }
+        if (matches[0].rm_eo > 0)
         {
-            type = entry->d_type == DT_DIR? T_Dir : 
-                   entry->d_type == DT_REG? T_File : 
-                   T_Other;
+            start += matches[0].rm_eo;
+            prevEmpty = false;
         }
         else
-#endif
-        {
-            struct stat st;
-            if (stat((realPath + "/" + entry->d_name).c_str(), &st) == 0)
-            {
-                type = S_ISDIR(st.st_mode)? T_Dir : 
-                       S_ISREG(st.st_mode)? T_File : 
-                       T_Other;
-            }
+        { //If an empty match is found advance just one char or else we'll get stuck in an infinite loop
+            if (start < name.size())
+                res += str[start];
+            start += 1;
+            prevEmpty = true;
         }
+        last = start;
+    } while (global && start <= name.size());
+    if (last < name.size())
+        res.append(str + last, name.size() - last);
+}
 
-        const std::string name = entry->d_name;
-        if (name.empty())
-            continue;
-        //if (name[0] == '.')
-        //    continue; //hidden?
-        if (name == "." || name == "..")
-            continue;
+enum SortMode
+{
+    SORT_NAME,      //collation order
+    SORT_NATURAL,   //collation order, but the runs of digits compare as numbers
+    SORT_MTIME,     //newest first
+    SORT_SIZE,      //largest first
+    SORT_MODES
+};
 
-        if (type == T_Dir)
-        {
-            if (name[0] == '.')
-                continue; //hidden folder
-            files.push_back(DirEntry(name, name, NULL, true));
-        }
-        else if (type == T_File)
+//These modes need the metadata of every entry, not only of those without d_type
+inline bool SortNeedsMetadata(SortMode sort)
+{
+    return sort == SORT_MTIME || sort == SORT_SIZE;
+}
+
+//The names used in the configuration file and in the remote commands
+static const char *g_sortNames[SORT_MODES] = { "name", "natural", "mtime", "size" };
+
+bool ParseSortMode(const std::string &name, SortMode &sort)
+{
+    for (int i = 0; i < SORT_MODES; ++i)
+    {
+        if (name == g_sortNames[i])
         {
-            FileAssoc *assoc = Match(name);
-            if (assoc)
-            {
-                std::string disp = TransformName(name);
-                files.push_back(DirEntry(disp, name, assoc, false));
-            }
+            sort = static_cast<SortMode>(i);
+            return true;
         }
     }
-
-    std::sort(files.begin(), files.end());
+    return false;
 }
 
-class OpenedFileLister : public Lister
+struct DirEntry
 {
-public:
-    OpenedFileLister(int id, const std::string &title)
-        :Lister(id), m_title(title)
-    {}
-    virtual std::string Title() 
-    { return m_title; }
-    virtual std::string Root()
-    { return ""; }
-    virtual bool Back(std::string &prev)
-    { return false; }
-    virtual void ChangePath(const DirEntry &entry)
-    {}
-    virtual void ChangePath(const std::string &path)
+    //dispName is the name shown to the user
+    //fileName is a lister-specific text to be used by Lister::ActualFile() to build the real file name
+    std::string dispName, fileName;
+    //sortKey is the first byte a SortClass, then the strxfrm() of dispName,
+    //so the entries are sorted with a plain binary comparison
+    std::string sortKey;
+    bool isDir;
+    //If lazyName, the sort uses fileName and dispName is computed with Lister::TransformName()
+    //only when it is shown. Until then nameReady is false and dispName is just fileName.
+    bool lazyName, nameReady;
+    FileAssoc *assoc;
+    //Only if the lister WantsMetadata(), else 0
+    uint32_t mtime;
+    uint64_t size;
+    DirEntry()
+        :isDir(false), lazyName(false), nameReady(true), assoc(NULL), mtime(0), size(0)
     {}
-    virtual void ListDir(std::vector<DirEntry> &files);
-    virtual std::string ActualFile(const DirEntry &entry)
-    { return entry.fileName; }
+    DirEntry(const std::string &disp, const std::string &file, FileAssoc *fa, bool d, SortMode sort = SORT_NAME)
+        :dispName(disp), fileName(file), isDir(d), lazyName(false), nameReady(true), assoc(fa), mtime(0), size(0)
+    {
+        //assert((fa == NULL) == isDir); //assoc is NULL iff !isDir
+        MakeSortKey(sort);
+    }
+    //Must be called whenever dispName, isDir or the metadata change
+    void MakeSortKey(SortMode sort);
+    void SetMetadata(const EntryStat &st)
+    {
+        mtime = st.mtime > 0? static_cast<uint32_t>(st.mtime) : 0;
+        size = st.size;
+    }
+    bool operator < (const DirEntry &o) const
+    {
+        return sortKey < o.sortKey;
+    }
 private:
-    std::string m_title;
+    //First of all the directories, and the top directory is always "..", if present.
+    enum SortClass { SORT_PARENT = 1, SORT_DIR, SORT_FILE };
 };
 
-void OpenedFileLister::ListDir(std::vector<DirEntry> &files)
+//Rewrites every run of digits as its number of digits, in two digits, followed by the
+//digits without leading zeros. "S1E10" becomes "S011E0210", so any collation
+//order sorts the numbers by value: "S1E2" < "S1E10".
+static std::string NaturalName(const std::string &name)
 {
-    OpenDir proc("/proc");
-    if (!proc)
-        return;
-    while (dirent *eproc = readdir(proc))
+    std::string res;
+    res.reserve(name.size() + 8);
+    for (size_t i = 0; i < name.size(); )
     {
-        char *end;
-        (void)(strtol(eproc->d_name, &end, 10) == 0); //to avoid the warn_unused_result
-        if (*end) //not an integer
-            continue;
-        std::string path = "/proc/";
-        path += eproc->d_name;
-        path += "/fd";
-
-        OpenDir fd(path);
-        if (!fd)
-            continue;
-        while (dirent *efd = readdir(fd))
+        if (!isdigit(static_cast<unsigned char>(name[i])))
         {
-            std::string s = path + "/" + efd->d_name;
-            char target[100];
-            int len = readlink(s.c_str(), target, sizeof(target) - 1);
-            if (len < 0)
-                continue;
-            target[len] = 0;
-            const char *slash = strrchr(target, '/');
-            if (slash)
-            {
-                ++slash;
-                const char *end = strchr(slash, ' '); //sometimes ' (deleted)' is added to the filename
-                if (!end)
-                    end = slash + strlen(slash);
-                std::string base(slash, end);
-                FileAssoc *assoc = Match(base);
-                if (assoc)
-                    files.push_back(DirEntry(base, s, assoc, false));
-            }
+            res += name[i++];
+            continue;
         }
+        while (i + 1 < name.size() && name[i] == '0' && isdigit(static_cast<unsigned char>(name[i + 1])))
+            ++i;
+        size_t end = i;
+        while (end < name.size() && isdigit(static_cast<unsigned char>(name[end])))
+            ++end;
+        size_t len = std::min<size_t>(end - i, 99);
+        res += static_cast<char>('0' + len / 10);
+        res += static_cast<char>('0' + len % 10);
+        res.append(name, i, end - i);
+        i = end;
     }
+    return res;
 }
 
-class AmuleLister : public Lister
+//Appends the strxfrm() of name to key
+static void AppendCollationKey(std::string &key, const char *name)
 {
-public:
-    AmuleLister(int id, const std::string &root)
-        :Lister(id), m_root(root)
-    {}
-    virtual std::string Title() 
-    { return "aMule"; }
-    virtual std::string Root()
-    { return ""; }
-    virtual bool Back(std::string &prev)
-    { return false; }
-    virtual void ChangePath(const DirEntry &entry)
+    size_t pos = key.size();
+    size_t len = strxfrm(NULL, name, 0);
+    key.resize(pos + len + 1);
+    strxfrm(&key[pos], name, len + 1);
+    key.resize(pos + len); //strxfrm() writes a terminating NUL, too
+}
+
+void DirEntry::MakeSortKey(SortMode sort)
+{
+    SortClass cls = !isDir? SORT_FILE : dispName == ".."? SORT_PARENT : SORT_DIR;
+    sortKey.assign(1, static_cast<char>(cls));
+    if (SortNeedsMetadata(sort))
+    {
+        //The complement in big endian, so that the largest values come first
+        uint64_t value = ~(sort == SORT_MTIME? uint64_t(mtime) : size);
+        for (int i = 56; i >= 0; i -= 8)
+            sortKey += static_cast<char>((value >> i) & 0xFF);
+    }
+    //Then use collation order
+    const std::string &sortName = lazyName? fileName : dispName;
+    if (sort != SORT_NATURAL)
+    {
+        AppendCollationKey(sortKey, sortName.c_str());
+        return;
+    }
+    //"E02" and "E2" have the same natural name, so they are ordered by the name itself.
+    //strxfrm() writes no NULs, so the NUL between them makes a shorter natural name go first.
+    AppendCollationKey(sortKey, NaturalName(sortName).c_str());
+    sortKey += '\0';
+    AppendCollationKey(sortKey, sortName.c_str());
+}
+
+//EntryList is a compact sequence of directory entries, for listings of up to millions
+//of files. All the strings live in a single arena addressed with 32-bit offsets, and the
+//display name shares the storage of the file name when they are equal, so the fixed
+//cost of an entry is that of EntryList::Item. The rows are read through an EntryView,
+//that is valid until the list is modified.
+class EntryList;
+
+class EntryView
+{
+public:
+    const char *DispName() const;
+    const char *FileName() const;
+    bool IsDir() const;
+    //If false, DispName() is still the file name, see DirEntry::lazyName
+    bool IsNameReady() const;
+    FileAssoc *Assoc() const;
+    uint32_t MTime() const;
+    uint64_t Size() const;
+private:
+    friend class EntryList;
+    const EntryList *m_list;
+    size_t m_index;
+
+    EntryView(const EntryList *list, size_t index)
+        :m_list(list), m_index(index)
     {}
-    virtual void ChangePath(const std::string &path)
+};
+
+class EntryList
+{
+public:
+    EntryList()
+        :m_dead(0), m_full(false)
     {}
-    virtual void ListDir(std::vector<DirEntry> &files);
-    virtual std::string ActualFile(const DirEntry &entry)
-    { return entry.fileName; }
+    size_t size() const
+    { return m_items.size(); }
+    bool empty() const
+    { return m_items.empty(); }
+    void clear()
+    {
+        m_items.clear();
+        m_arena.clear();
+        m_dead = 0;
+        m_full = false;
+    }
+    void swap(EntryList &o)
+    {
+        m_items.swap(o.m_items);
+        m_arena.swap(o.m_arena);
+        std::swap(m_dead, o.m_dead);
+        std::swap(m_full, o.m_full);
+    }
+    EntryView operator[](size_t i) const
+    { return EntryView(this, i); }
+    //Builds a full copy of the entry
+    DirEntry Get(size_t i) const;
+
+    //The strings are addressed with 32-bit offsets, so once they take 4 GiB these refuse
+    //the entries: they return false, and Full() is true until the list is cleared
+    bool push_back(const DirEntry &entry);
+    //Copies an entry from another list, without rebuilding it
+    bool push_back(const EntryList &other, size_t i);
+    bool append(const EntryList &other);
+    bool insert(size_t pos, const DirEntry &entry);
+    bool Full() const
+    { return m_full; }
+    //If the strings of both would fit in a single list
+    static bool FitTogether(const EntryList &a, const EntryList &b)
+    { return a.Fits(b.m_arena.size()); }
+    //The strings left unused by these two are reclaimed once they are a good part of the arena
+    void erase(size_t pos);
+    //Stores the computed display name of a lazyName entry
+    void SetDispName(size_t i, const std::string &dispName);
+
+    //Sorts by the sort keys. If newPos is not NULL it gets the new position of
+    //every entry, indexed by the old one.
+    void Sort(std::vector<int> *newPos);
+    //The position where the entry would be inserted to keep the order
+    size_t UpperBound(const DirEntry &entry) const;
+    //The position of the entry with the same sort key and file name, or size() if none
+    size_t Find(const DirEntry &entry) const;
+    //Compares the sort keys of two entries, that may be of different lists
+    static bool Less(const EntryList &a, size_t ia, const EntryList &b, size_t ib);
+    size_t Bytes() const
+    { return m_items.capacity() * sizeof(Item) + m_arena.capacity(); }
 private:
-    std::string m_root;
+    friend class EntryView;
+    enum { F_DIR = 1, F_LAZY_NAME = 2, F_NAME_READY = 4 };
+    struct Item
+    {
+        uint32_t file, disp, key, keyLen; //offsets into m_arena, and the key may contain NULs
+        FileAssoc *assoc;
+        uint64_t size;
+        uint32_t mtime;
+        uint8_t flags;
+    };
+    std::vector<Item> m_items;
+    std::vector<char> m_arena;
+    size_t m_dead; //bytes of m_arena that no item uses
+    bool m_full; //an entry has been refused
+    //The arena is compacted when it has more dead bytes than these and than live ones
+    enum { COMPACT_MIN = 64 * 1024 };
+
+    struct ItemLess
+    {
+        const char *arena;
+        ItemLess(const char *a)
+            :arena(a)
+        {}
+        bool operator()(const Item &a, const Item &b) const
+        { return Compare(arena + a.key, a.keyLen, arena + b.key, b.keyLen) < 0; }
+    };
+    struct IndexLess
+    {
+        const EntryList &list;
+        IndexLess(const EntryList &l)
+            :list(l)
+        {}
+        bool operator()(int a, int b) const
+        { return Less(list, a, list, b); }
+    };
+
+    static int Compare(const char *a, size_t na, const char *b, size_t nb);
+    bool Fits(size_t more) const;
+    uint32_t Store(const char *data, size_t len);
+    void Compact();
+    bool MakeItem(const DirEntry &entry, Item &item);
+    const char *Str(uint32_t offset) const
+    { return &m_arena[offset]; }
 };
 
-void AmuleLister::ListDir(std::vector<DirEntry> &files)
+inline const char *EntryView::DispName() const
+{ return m_list->Str(m_list->m_items[m_index].disp); }
+inline const char *EntryView::FileName() const
+{ return m_list->Str(m_list->m_items[m_index].file); }
+inline bool EntryView::IsDir() const
+{ return (m_list->m_items[m_index].flags & EntryList::F_DIR) != 0; }
+inline bool EntryView::IsNameReady() const
+{ return (m_list->m_items[m_index].flags & EntryList::F_NAME_READY) != 0; }
+inline FileAssoc *EntryView::Assoc() const
+{ return m_list->m_items[m_index].assoc; }
+inline uint32_t EntryView::MTime() const
+{ return m_list->m_items[m_index].mtime; }
+inline uint64_t EntryView::Size() const
+{ return m_list->m_items[m_index].size; }
+
+/*static*/int EntryList::Compare(const char *a, size_t na, const char *b, size_t nb)
 {
-    OpenDir dir(m_root);
-    if (!dir)
-        return;
+    int r = memcmp(a, b, std::min(na, nb));
+    if (r != 0)
+        return r;
+    return na < nb? -1 : na > nb? 1 : 0;
+}
 
-    while (dirent *entry = readdir(dir))
-    {
-#ifdef _DIRENT_HAVE_D_TYPE
-        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
-        {
-            if (entry->d_type != DT_REG)
-                continue;
-        }
-        else
-#endif
-        {
-            struct stat st;
-            if (stat((m_root + "/" + entry->d_name).c_str(), &st) < 0 ||
-                    !S_ISREG(st.st_mode))
-               continue;
-        }
+//The offsets are 32-bit, so the arena cannot grow past 4 GiB
+bool EntryList::Fits(size_t more) const
+{
+    return more <= static_cast<size_t>(static_cast<uint32_t>(-1)) - m_arena.size();
+}
 
-        size_t len = strlen(entry->d_name);
-        if (len < 4 || strcmp(entry->d_name + len - 4, ".met") != 0)
-            continue;
-        std::ifstream ifs((m_root + "/" + entry->d_name).c_str(), std::ios::binary);
-        //g_print("File: %s\n", entry->d_name);
-        uint8_t version;
-        ifs.read((char*)&version, 1);
-        if (version != 0xE0)
-            continue;
-        ifs.ignore(4 + 16); //date + hash
-        uint16_t parts;
-        ifs.read((char*)&parts, 2);
-        ifs.ignore(parts * 16); //hashes
-        uint32_t tags;
-        ifs.read((char*)&tags, 4);
-        for (uint32_t i = 0; i < tags; ++i)
-        {
-            uint8_t type, uname;
-            ifs.read((char*)&type, 1);
-            if (type & 0x80)
-            {
-                type &= 0x7F;
-                ifs.read((char*)&uname, 1);
-	    }
-            else
-            {
-                uint16_t len;
-                ifs.read((char*)&len, 2);
-                if (len == 1)
-                    ifs.read((char*)&uname, 1);
-                else
-                {
-                    uname = 0xFF;
-                    ifs.ignore(len);
-                }
-            }
-            switch (type)
-            {
-            case 1: //HASH16
-                ifs.ignore(16);
-                break;
-            case 2: //STRING
-                {
-                    uint16_t slen;
-                    ifs.read((char*)&slen, 2);
-                    std::vector<char> s(slen + 1);
-                    ifs.read(s.data(), slen);
-                    //g_print("\t%d: '%s'\n", uname, s.data());
-                    if (uname == 1) //filename
-                    {
-                        std::string name(s.data());
-                        FileAssoc *assoc = Match(name);
-                        if (assoc)
-                            files.push_back(DirEntry(name, m_root + "/" + std::string(entry->d_name, len - 4), assoc, false));
-                        goto next;
-                    }
-                }
-                break;
-            case 3: //UINT32
-                ifs.ignore(4);
-                break;
-            case 4: //FLOAT32
-                ifs.ignore(4);
-                break;
-            case 5: //BOOL
-                ifs.ignore(1);
-                break;
-            case 11://UINT64
-                ifs.ignore(8);
-                break;
-            case 8: //UINT16
-                ifs.ignore(2);
-                break;
-            case 9: //UINT8
-                ifs.ignore(1);
-                break;
-            case 6: //BOOLARRAY
-                //TODO
-            case 7: //BLOB
-                //TODO
-            case 10://BSOB
-                //TODO
-            default:
-                goto next;
-            }
-        }
-next:;
-    }
-    std::sort(files.begin(), files.end());
+//Stores the data and a terminating NUL, that must fit
+uint32_t EntryList::Store(const char *data, size_t len)
+{
+    uint32_t offset = m_arena.size();
+    m_arena.insert(m_arena.end(), data, data + len);
+    m_arena.push_back('\0');
+    return offset;
 }
 
-struct GraphicOptions
+bool EntryList::MakeItem(const DirEntry &entry, Item &item)
 {
-    std::string descFont, descFontTitle, descFontQueue;
-    struct Color
+    bool shared = entry.dispName == entry.fileName;
+    if (!Fits(entry.fileName.size() + 1 + (shared? 0 : entry.dispName.size() + 1) + entry.sortKey.size() + 1))
     {
-        double r, g, b;
+        m_full = true;
+        return false;
+    }
+    item.file = Store(entry.fileName.data(), entry.fileName.size());
+    if (shared)
+        item.disp = item.file;
+    else
+        item.disp = Store(entry.dispName.data(), entry.dispName.size());
+    item.key = Store(entry.sortKey.data(), entry.sortKey.size());
+    item.keyLen = entry.sortKey.size();
+    item.assoc = entry.assoc;
+    item.size = entry.size;
+    item.mtime = entry.mtime;
+    item.flags = (entry.isDir? F_DIR : 0) | (entry.lazyName? F_LAZY_NAME : 0) |
+        (entry.nameReady? F_NAME_READY : 0);
+    return true;
+}
 
-        void set_source(cairo_t *cr)
-        {
-            cairo_set_source_rgb(cr, r, g, b);
-        }
-    };
-    Color colorFg, colorFgQ, colorBg, colorScroll;
+DirEntry EntryList::Get(size_t i) const
+{
+    const Item &item = m_items[i];
+    DirEntry entry;
+    entry.fileName = Str(item.file);
+    entry.dispName = Str(item.disp);
+    entry.sortKey.assign(Str(item.key), item.keyLen);
+    entry.isDir = (item.flags & F_DIR) != 0;
+    entry.lazyName = (item.flags & F_LAZY_NAME) != 0;
+    entry.nameReady = (item.flags & F_NAME_READY) != 0;
+    entry.assoc = item.assoc;
+    entry.mtime = item.mtime;
+    entry.size = item.size;
+    return entry;
+}
 
-    GraphicOptions()
+bool EntryList::push_back(const DirEntry &entry)
+{
+    Item item;
+    if (!MakeItem(entry, item))
+        return false;
+    m_items.push_back(item);
+    return true;
+}
+
+bool EntryList::push_back(const EntryList &other, size_t i)
+{
+    Item item = other.m_items[i];
+    const Item &src = other.m_items[i];
+    size_t fileLen = strlen(other.Str(src.file));
+    size_t dispLen = src.disp == src.file? 0 : strlen(other.Str(src.disp));
+    if (!Fits(fileLen + 1 + (src.disp == src.file? 0 : dispLen + 1) + src.keyLen + 1))
     {
-        descFont = "Sans 24";
-        descFontTitle = "Sans Bold 40";
-        descFontQueue = "Sans 16";
-        colorFg.r = colorFg.g = colorFg.b = 1;
-        colorFgQ.r = colorFgQ.g = 1; colorFgQ.b = 0.5;
-        colorBg.r = colorBg.g = colorBg.b = 0;
-        colorScroll.r = colorScroll.g = colorScroll.b = 0.75;
+        m_full = true;
+        return false;
     }
-};
+    item.file = Store(other.Str(src.file), fileLen);
+    if (src.disp == src.file)
+        item.disp = item.file;
+    else
+        item.disp = Store(other.Str(src.disp), dispLen);
+    item.key = Store(other.Str(src.key), src.keyLen);
+    m_items.push_back(item);
+    return true;
+}
 
-struct Options
+bool EntryList::append(const EntryList &other)
 {
-    GraphicOptions gr;
-    std::vector<FileAssoc*> assocs;
-    std::vector<NameTrans*> nameTrans;
-    std::vector<Lister*> favorites;
-
-    ~Options()
+    if (empty() && !m_full)
     {
-        for (size_t i = 0; i < assocs.size(); ++i)
-            delete assocs[i];
-        for (size_t i = 0; i < nameTrans.size(); ++i)
-            delete nameTrans[i];
-        for (size_t i = 0; i < favorites.size(); ++i)
-            delete favorites[i];
+        *this = other;
+        return true;
     }
-} g_options;
+    m_full = m_full || other.m_full;
+    if (!Fits(other.m_arena.size()))
+    {
+        //As many as fit, one by one, without the dead strings of other
+        for (size_t i = 0; i < other.size(); ++i)
+        {
+            if (!push_back(other, i))
+                return false;
+        }
+        return true;
+    }
+    //The arena is copied as is, so just move the offsets
+    uint32_t base = m_arena.size();
+    m_arena.insert(m_arena.end(), other.m_arena.begin(), other.m_arena.end());
+    m_dead += other.m_dead;
+    m_items.reserve(m_items.size() + other.m_items.size());
+    for (size_t i = 0; i < other.m_items.size(); ++i)
+    {
+        Item item = other.m_items[i];
+        item.file += base;
+        item.disp += base;
+        item.key += base;
+        m_items.push_back(item);
+    }
+    return true;
+}
 
-/*static*/FileAssoc *FileAssoc::MatchGlobal(const std::string &file)
+bool EntryList::insert(size_t pos, const DirEntry &entry)
 {
-    return FileAssoc::Match(g_options.assocs, file);
+    Item item;
+    if (!MakeItem(entry, item))
+        return false;
+    m_items.insert(m_items.begin() + pos, item);
+    return true;
 }
-/*static*/FileAssoc *FileAssoc::Match(const std::vector<FileAssoc*> &assocs, const std::string &file)
+
+void EntryList::erase(size_t pos)
 {
-    bool isGlobal = &g_options.assocs == &assocs;
+    const Item &item = m_items[pos];
+    m_dead += strlen(Str(item.file)) + 1 + item.keyLen + 1;
+    if (item.disp != item.file)
+        m_dead += strlen(Str(item.disp)) + 1;
+    m_items.erase(m_items.begin() + pos);
+    Compact();
+}
 
-    //If no associations are defined use the default
-    if (!isGlobal && assocs.empty())
-        return MatchGlobal(file);
+void EntryList::SetDispName(size_t i, const std::string &dispName)
+{
+    Item &item = m_items[i];
+    if (dispName == Str(item.disp))
+    {
+        item.flags |= F_NAME_READY;
+        return;
+    }
+    if (item.disp != item.file)
+        m_dead += strlen(Str(item.disp)) + 1;
+    if (dispName == Str(item.file))
+        item.disp = item.file;
+    else if (Fits(dispName.size() + 1))
+        item.disp = Store(dispName.data(), dispName.size());
+    else
+        item.disp = item.file; //shown with the file name
+    item.flags |= F_NAME_READY;
+    Compact();
+}
 
-    for (size_t i = 0; i < assocs.size(); ++i)
+//Copies the live strings to a new arena, if there are enough dead ones
+void EntryList::Compact()
+{
+    if (m_dead <= COMPACT_MIN || m_dead <= m_arena.size() - m_dead)
+        return;
+    std::vector<char> arena;
+    arena.reserve(m_arena.size() - m_dead);
+    for (size_t i = 0; i < m_items.size(); ++i)
     {
-        FileAssoc *assoc = assocs[i];
-        if (assoc)
+        Item &item = m_items[i];
+        const char *file = Str(item.file), *disp = Str(item.disp);
+        uint32_t offset = arena.size();
+        arena.insert(arena.end(), file, file + strlen(file) + 1);
+        if (item.disp != item.file)
         {
-            if (regexec(assoc->regex, file.c_str(), 0, NULL, 0) == REG_NOERROR)
-                return assoc;
-        }
-        else if (!isGlobal)
-        {
-            assoc = MatchGlobal(file);
-            if (assoc)
-                return assoc;
+            item.disp = arena.size();
+            arena.insert(arena.end(), disp, disp + strlen(disp) + 1);
         }
+        else
+            item.disp = offset;
+        item.file = offset;
+        const char *key = Str(item.key);
+        item.key = arena.size();
+        arena.insert(arena.end(), key, key + item.keyLen);
+        arena.push_back('\0');
     }
-    return NULL;
+    m_arena.swap(arena);
+    m_dead = 0;
 }
 
-/*static*/std::string NameTrans::TransformName(const std::vector<NameTrans*> &trans, const std::string &name)
+void EntryList::Sort(std::vector<int> *newPos)
 {
-    std::string res(name);
-    for (size_t i = 0; i < trans.size(); ++i)
+    if (!newPos)
+    {
+        //The items are small, so they are sorted in place
+        std::sort(m_items.begin(), m_items.end(), ItemLess(m_arena.empty()? NULL : &m_arena[0]));
+        return;
+    }
+    std::vector<int> order(m_items.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), IndexLess(*this));
+    std::vector<Item> sorted(m_items.size());
+    newPos->resize(m_items.size());
+    for (size_t i = 0; i < order.size(); ++i)
     {
-        const NameTrans &re = *trans[i];
-        res = re.TransformName(res);
+        sorted[i] = m_items[order[i]];
+        (*newPos)[order[i]] = i;
     }
-    return res;
+    m_items.swap(sorted);
 }
 
-/*static*/std::string NameTrans::TransformNameGlobal(const std::string &name)
+size_t EntryList::UpperBound(const DirEntry &entry) const
 {
-    return NameTrans::TransformName(g_options.nameTrans, name);
+    size_t lo = 0, hi = m_items.size();
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const Item &item = m_items[mid];
+        if (Compare(entry.sortKey.data(), entry.sortKey.size(), Str(item.key), item.keyLen) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
 }
 
-class MainWnd : private ILircClient
+size_t EntryList::Find(const DirEntry &entry) const
 {
-public:
-    MainWnd(const std::string &lircFile);
-
-private:
-    GtkWindowPtr m_wnd;
-    GtkDrawingAreaPtr m_draw;
-    LircClient m_lirc;
-    Lister *m_lister;
-    int m_lineSel, m_firstLine, m_nLines;
-    std::vector<DirEntry> m_files;
-    std::vector<int> m_playQueue;
-    GPid m_childPid;
-    std::string m_childText;
-    bool m_isKillable;
+    for (size_t pos = UpperBound(entry); pos > 0; --pos)
+    {
+        const Item &item = m_items[pos - 1];
+        if (Compare(entry.sortKey.data(), entry.sortKey.size(), Str(item.key), item.keyLen) != 0)
+            break;
+        if (entry.fileName == Str(item.file))
+            return pos - 1;
+    }
+    return m_items.size();
+}
 
-    AutoTimeout m_timeoutSpawned;
-    gboolean OnTimeoutSpawned();
+/*static*/bool EntryList::Less(const EntryList &a, size_t ia, const EntryList &b, size_t ib)
+{
+    const Item &x = a.m_items[ia], &y = b.m_items[ib];
+    return Compare(a.Str(x.key), x.keyLen, b.Str(y.key), y.keyLen) < 0;
+}
 
-    AutoTimeout m_timeoutClock;
-    gboolean OnTimeoutClock();
+class MutexLock
+{
+public:
+    MutexLock(GMutex *mutex)
+        :m_mutex(mutex)
+    {
+        g_mutex_lock(m_mutex);
+    }
+    ~MutexLock()
+    {
+        g_mutex_unlock(m_mutex);
+    }
+private:
+    GMutex *m_mutex;
+};
 
-    PangoFontDescriptionPtr m_font, m_fontTitle, m_fontQueue;
+//A flag that can be raised from the main thread and polled from a worker
+class CancelToken
+{
+public:
+    CancelToken()
+        :m_cancelled(0)
+    {}
+    void Cancel()
+    {
+        g_atomic_int_set(&m_cancelled, 1);
+    }
+    void Reset()
+    {
+        g_atomic_int_set(&m_cancelled, 0);
+    }
+    bool IsCancelled() const
+    {
+        return g_atomic_int_get(&m_cancelled) != 0;
+    }
+private:
+    volatile gint m_cancelled;
+};
 
-    void OnDestroy(GtkWidget *w)
+//MountHealth remembers the mounts where a listing got stuck, usually network filesystems
+//whose server is down, so that the next visits fail at once instead of blocking again.
+//A mount recovers when its stuck worker returns, and it is tried again after a while anyway.
+class MountHealth
+{
+public:
+    enum { RETRY_SECONDS = 30 };
+    MountHealth()
     {
-        gtk_main_quit();
+        g_mutex_init(&m_mutex);
     }
-#if GTK_MAJOR_VERSION < 3
-    gboolean OnDrawExpose(GtkWidget *w, GdkEventExpose *e);
-#else
-    gboolean OnDrawDraw(GtkWidget *w, cairo_t *cr);
-#endif
-    void OnDrawCairo(cairo_t *cr, int width, int height);
-    gboolean OnDrawKey(GtkWidget *w, GdkEventKey *e);
-    int PositionInQueue(int line);
-    void Move(int inc);
-    void Select(bool onlyDir);
-    void Queue();
-    void Unqueue();
-    void Back();
-    void Refresh();
-    bool ChangeFavorite(int nfav);
-    void Open(const DirEntry &entry);
-    void AfterRun();
-    void OnChildWatch(GPid pid, gint status);
+    ~MountHealth()
+    {
+        g_mutex_clear(&m_mutex);
+    }
+    //A worker listing path has been abandoned
+    void Stalled(const std::string &path);
+    //That worker has returned
+    void Recovered(const std::string &path);
+    //If true, path should not be touched
+    bool IsStalled(const std::string &path);
+    //The user asks to try again now
+    void Retry(const std::string &path);
+private:
+    struct State
+    {
+        int stuck; //workers still blocked
+        gint64 since;
+    };
+    typedef std::map<std::string, State> mounts_t;
+    //These are protected by m_mutex
+    GMutex m_mutex;
+    mounts_t m_mounts; //by mount point
 
-    void Redraw();
+    static std::string MountPoint(const std::string &path);
 
-    //ILircClient
-    virtual void OnLircCommand(const char *cmd);
+    MountHealth(const MountHealth &); //nocopy
+    void operator=(const MountHealth &); //nocopy
 };
 
+void MountHealth::Stalled(const std::string &path)
+{
+    std::string mnt = MountPoint(path);
+    MutexLock lock(&m_mutex);
+    State &st = m_mounts[mnt]; //new ones are zero-initialized
+    ++st.stuck;
+    st.since = g_get_monotonic_time();
+    if (g_verbose)
+        std::cout << "Mount not responding: " << mnt << std::endl;
+}
 
-MainWnd::MainWnd(const std::string &lircFile)
-    :m_lirc(lircFile, this), m_childPid(0), m_isKillable(false)
+void MountHealth::Recovered(const std::string &path)
 {
-    m_lister = &g_defaultLister;
+    std::string mnt = MountPoint(path);
+    MutexLock lock(&m_mutex);
+    mounts_t::iterator it = m_mounts.find(mnt);
+    if (it == m_mounts.end())
+        return;
+    if (--it->second.stuck <= 0)
+    {
+        m_mounts.erase(it);
+        if (g_verbose)
+            std::cout << "Mount responding again: " << mnt << std::endl;
+    }
+}
 
-    m_wnd.Reset( gtk_window_new(GTK_WINDOW_TOPLEVEL) );
-    MIGTK_WIDGET_destroy(m_wnd, MainWnd, OnDestroy, this);
+bool MountHealth::IsStalled(const std::string &path)
+{
+    MutexLock lock(&m_mutex);
+    //The usual case, without reading the mount table
+    if (m_mounts.empty())
+        return false;
+    mounts_t::iterator it = m_mounts.find(MountPoint(path));
+    if (it == m_mounts.end())
+        return false;
+    return g_get_monotonic_time() - it->second.since < RETRY_SECONDS * G_TIME_SPAN_SECOND;
+}
 
-    m_draw.Reset( gtk_drawing_area_new() );
-#if GTK_MAJOR_VERSION < 3
-    MIGTK_WIDGET_expose_event(m_draw, MainWnd, OnDrawExpose, this);
-    GdkColor black = {0, 0xFFFF * g_options.gr.colorBg.r, 0xFFFF * g_options.gr.colorBg.g, 0xFFFF * g_options.gr.colorBg.b};
-    gtk_widget_modify_bg(m_draw, GTK_STATE_NORMAL, &black);
-#else
-    MIGTK_WIDGET_draw(m_draw, MainWnd, OnDrawDraw, this);
-    GdkRGBA black = {g_options.gr.colorBg.r, g_options.gr.colorBg.g, g_options.gr.colorBg.b, 1.0};
-    gtk_widget_override_background_color(m_draw, GTK_STATE_FLAG_NORMAL, &black);
+void MountHealth::Retry(const std::string &path)
+{
+    MutexLock lock(&m_mutex);
+    if (m_mounts.empty())
+        return;
+    mounts_t::iterator it = m_mounts.find(MountPoint(path));
+    if (it != m_mounts.end())
+        it->second.since = 0;
+}
+
+//The longest mount point that contains path.
+//The mount table is read from /proc, which does not touch the mounted filesystems.
+/*static*/std::string MountHealth::MountPoint(const std::string &path)
+{
+    std::string best = "/";
+    FILE *f = setmntent("/proc/self/mounts", "r");
+    if (!f)
+        return best;
+    while (struct mntent *mnt = getmntent(f))
+    {
+        size_t len = strlen(mnt->mnt_dir);
+        if (len <= best.size() || path.compare(0, len, mnt->mnt_dir) != 0)
+            continue;
+        if (path.size() == len || path[len] == '/')
+            best = mnt->mnt_dir;
+    }
+    endmntent(f);
+    return best;
+}
+
+MountHealth g_mountHealth;
+
+//DirSink receives the entries produced by Lister::ListDir(), in no particular order.
+//They are delivered in batches: the first ones are small, so that something can be
+//shown quickly, and then they grow to make the merging cheaper.
+class DirSink
+{
+public:
+    DirSink()
+        :m_batchSize(FIRST_BATCH), m_io(0)
+    {}
+    virtual ~DirSink()
+    {}
+    //If true, ListDir() should return as soon as possible
+    virtual bool IsCancelled() const
+    { return false; }
+    //The calls to the filesystem made for the sink, so that a background listing can have a budget.
+    //Called by the listing thread before doing them, read from any thread.
+    void CountIo(unsigned calls)
+    { g_atomic_int_add(&m_io, static_cast<gint>(calls)); }
+    unsigned IoCount() const
+    { return g_atomic_int_get(&m_io); }
+    void ResetIo()
+    { g_atomic_int_set(&m_io, 0); }
+    //A recursive listing is about to read its subdirectory rel, relative to the top one.
+    //Called from any of its threads.
+    virtual void EnterSubDir(const std::string &rel)
+    {}
+    void Add(const DirEntry &entry)
+    {
+        m_batch.push_back(entry);
+        if (m_batch.size() >= m_batchSize)
+            Flush();
+    }
+    void Add(const EntryList &list, size_t i)
+    {
+        m_batch.push_back(list, i);
+        if (m_batch.size() >= m_batchSize)
+            Flush();
+    }
+    //An entry sent before that must go, see Lister::PruneDir(). It goes with the next batch.
+    void Remove(const DirEntry &entry)
+    {
+        m_removed.push_back(entry);
+    }
+    void Flush()
+    {
+        if (!m_removed.empty())
+        {
+            OnRemoved(m_removed);
+            m_removed.clear();
+        }
+        if (m_batch.empty())
+            return;
+        OnBatch(m_batch);
+        m_batch.clear();
+        if (m_batchSize < MAX_BATCH)
+            m_batchSize *= 2;
+    }
+protected:
+    //The implementation may steal the contents of the batch
+    virtual void OnBatch(EntryList &batch) =0;
+    virtual void OnRemoved(EntryList &removed)
+    {}
+private:
+    enum { FIRST_BATCH = 64, MAX_BATCH = 4096 };
+    EntryList m_batch, m_removed;
+    size_t m_batchSize;
+    volatile gint m_io;
+};
+
+//A DirSink that just collects the entries
+class ListSink : public DirSink
+{
+public:
+    EntryList files;
+protected:
+    virtual void OnBatch(EntryList &batch)
+    {
+        files.append(batch);
+    }
+};
+
+//A directory of a lister to be listed in the background.
+//It is taken in the main loop, so that the worker needs nothing from the lister that may change.
+class Lister;
+struct PrefetchTarget
+{
+    //The calls to the filesystem before giving up on a target, see DirSink::CountIo().
+    //An open directory is one, a stat is one and reading the entries is one per READ_ENTRIES.
+    enum { MAX_IO = 1000, READ_ENTRIES = 128 };
+    Lister *lister;
+    OpenFd parentFd; //or -1 to open path
+    std::string name;
+    std::string path; //of the directory
+    int depth; //levels of subdirectories to list too
+    std::set<std::string> shown; //for a prune, the subdirectories shown now
+    PrefetchTarget()
+        :lister(NULL), depth(0)
+    {}
+};
+
+class Lister
+{
+public:
+    Lister(int id)
+        :m_id(id), m_sort(SORT_NAME), m_metadata(false)
+    {}
+    virtual ~Lister()
+    {
+        for (size_t i = 0; i < m_assocs.size(); ++i)
+            delete m_assocs[i];
+        for (size_t i = 0; i < m_nameTrans.size(); ++i)
+            delete m_nameTrans[i];
+    }
+    void AddAssoc(FileAssoc *fa)
+    {
+        m_assocs.push_back(fa);
+    }
+    void AddDefaultAssoc()
+    {
+        m_assocs.push_back(NULL);
+    }
+    void AddNameTransform(NameTrans *nt)
+    {
+        m_nameTrans.push_back(nt);
+    }
+    int Id()
+    { return m_id; }
+    //The entries of the listing must be built with this sort mode
+    void SetSortMode(SortMode sort)
+    {
+        m_sort = sort;
+        //Once needed, keep it, so that the sort mode can be changed without listing again
+        if (SortNeedsMetadata(sort))
+            m_metadata = true;
+    }
+    SortMode GetSortMode() const
+    { return m_sort; }
+    //If true, the entries must carry their mtime and size
+    bool WantsMetadata() const
+    { return m_metadata; }
+
+    virtual std::string Title() =0;
+    virtual std::string Root() =0;
+    //Changing the path must not block: the directory is opened when it is listed
+    virtual void ChangePath(const DirEntry &entry) =0;
+    virtual void ChangePath(const std::string &path) =0;
+    virtual bool Back(std::string &prev) =0; //returns false if going back from root directory
+    //Called when the lister stops being the current one: it must close whatever it keeps
+    //open of the filesystem, so that it does not keep a mount busy
+    virtual void ReleaseDirs()
+    {}
+    //ListDir() is run from a worker thread, so it must not modify the lister, but
+    //for what it protects with its own lock
+    virtual void ListDir(DirSink &sink) =0;
+    virtual std::string ActualFile(const DirEntry &entry) =0;
+
+    //For listers that show a real directory: the path to watch for changes, or empty.
+    virtual std::string WatchPath()
+    { return ""; }
+    //If true, the listing depends on more than the directory: it shows the files of the whole
+    //tree, or hides the subdirectories without media
+    virtual bool DependsOnSubtree() const
+    { return false; }
+    //If true, the listing has the files of the whole tree, named by their path relative to the
+    //directory, and no subdirectories
+    virtual bool IsRecursive() const
+    { return false; }
+    //To list the subdirectory entry only to fill the listing cache, without changing the path.
+    //BeginPrefetch() is called from the main loop and must not touch the filesystem, it returns
+    //false if not supported. PrefetchDir() is run from a worker thread, like ListDir().
+    virtual bool BeginPrefetch(const DirEntry &entry, PrefetchTarget &target)
+    { return false; }
+    //The same for the root of the lister, at startup
+    virtual bool BeginWarmUp(int depth, PrefetchTarget &target)
+    { return false; }
+    //For the Snapshot: SavePath() gets the current path, RestorePath() sets it back without
+    //touching the filesystem, and RebuildEntry() makes an entry from what was saved.
+    //They return false if not supported.
+    virtual bool SavePath(std::string &path)
+    { return false; }
+    virtual bool RestorePath(const std::string &path)
+    { return false; }
+    virtual bool RebuildEntry(const std::string &name, bool isDir, uint32_t mtime, uint64_t size, DirEntry &entry)
+    { return false; }
+    virtual void PrefetchDir(const PrefetchTarget &target, DirSink &sink)
+    {}
+    //For the listers that hide the subdirectories without media: after the listing, PruneDir()
+    //checks every subdirectory of the target and sends to the sink those that must change:
+    //with Add() if it is to be shown, and with Remove() if it is to be hidden.
+    //BeginPrune() is called from the main loop, like BeginPrefetch(), and the caller fills
+    //the shown set of the target.
+    virtual bool BeginPrune(PrefetchTarget &target)
+    { return false; }
+    virtual void PruneDir(const PrefetchTarget &target, DirSink &sink)
+    {}
+    //Builds the entry for a single file of the current directory. Returns false if it should not be shown.
+    virtual bool ListEntry(const std::string &name, DirEntry &entry)
+    { return false; }
+
+    //Resolves the <default> entries and compiles the associations into m_matcher.
+    //To be called once the configuration is loaded, until then Match() uses the lists as they are.
+    void PrepareAssocs();
+    virtual FileAssoc *Match(const char *file)
+    {
+        if (m_matcher.IsReady())
+            return m_matcher.Match(file);
+        return FileAssoc::Match(m_assocs, file);
+    }
+
+    std::string TransformName(const std::string &name) const
+    {
+        if (!m_nameTrans.empty())
+            return NameTrans::TransformName(m_nameTrans, name);
+        else
+            return NameTrans::TransformNameGlobal(name);
+    }
+    //res must not be name
+    void TransformName(const std::string &name, std::string &res) const
+    {
+        NameTrans::TransformName(!m_nameTrans.empty()? m_nameTrans : NameTrans::Global(), name, res);
+    }
+    //Unless the transformations affect the sort, the display names are left to
+    //the viewer, that calls TransformName() only for the rows it shows.
+    bool HasNameTransforms() const
+    {
+        return !m_nameTrans.empty() || !NameTrans::Global().empty();
+    }
+    bool TransformsWhileListing() const
+    {
+        return NameTrans::AffectsSort(!m_nameTrans.empty()? m_nameTrans : NameTrans::Global());
+    }
+    //As TransformName(), but if no transformation matches name it returns false and leaves
+    //res alone. The stages that do not match are not run again.
+    bool TransformIfChanges(const std::string &name, std::string &res) const
+    {
+        const std::vector<NameTrans*> &trans = !m_nameTrans.empty()? m_nameTrans : NameTrans::Global();
+        size_t first = NameTrans::FirstChange(trans, name.c_str());
+        if (first == trans.size())
+            return false;
+        NameTrans::TransformName(trans, name, res, first);
+        return true;
+    }
+
+private:
+    int m_id;
+    SortMode m_sort;
+    bool m_metadata;
+    //Smart hack: A NULL value in the m_assocs vector means to search into MatchGlobal recursively.
+    std::vector<FileAssoc*> m_assocs;
+    AssocMatcher m_matcher;
+    std::vector<NameTrans*> m_nameTrans;
+    
+};
+
+//NameMemo remembers the display names of the files of one lister whose transformations
+//affect the sort, so that a directory listed again, after a change or in another sort,
+//does not run the regexes again. It goes with the lister, and so with the configuration.
+//It is looked up and filled once per chunk of names, not once per name, so the threads
+//of the classify pool seldom wait for it. When it is full it is emptied.
+class NameMemo
+{
+public:
+    enum { MAX_BYTES = 16 << 20 };
+    NameMemo();
+    ~NameMemo();
+    //Sets disp[i] to the display name of names[i] and known[i] to true if it is known
+    void Lookup(const std::vector<const char*> &names, std::vector<std::string> &disp, std::vector<char> &known);
+    //Of the file names and their display names
+    void Insert(const std::vector<std::pair<std::string, std::string> > &learnt);
+    void PrintStats();
+private:
+    typedef std::map<std::string, std::string> names_t;
+    GMutex m_mutex;
+    names_t m_names;
+    size_t m_bytes;
+    unsigned m_hits, m_misses;
+
+    NameMemo(const NameMemo &); //nocopy
+    void operator=(const NameMemo &); //nocopy
+};
+
+NameMemo::NameMemo()
+    :m_bytes(0), m_hits(0), m_misses(0)
+{
+    g_mutex_init(&m_mutex);
+}
+
+NameMemo::~NameMemo()
+{
+    g_mutex_clear(&m_mutex);
+}
+
+void NameMemo::Lookup(const std::vector<const char*> &names, std::vector<std::string> &disp, std::vector<char> &known)
+{
+    disp.resize(names.size());
+    known.assign(names.size(), false);
+    MutexLock lock(&m_mutex);
+    if (m_names.empty())
+        return;
+    std::string name;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        name = names[i];
+        names_t::const_iterator it = m_names.find(name);
+        if (it != m_names.end())
+        {
+            disp[i] = it->second;
+            known[i] = true;
+            ++m_hits;
+        }
+    }
+}
+
+void NameMemo::Insert(const std::vector<std::pair<std::string, std::string> > &learnt)
+{
+    if (learnt.empty())
+        return;
+    MutexLock lock(&m_mutex);
+    m_misses += learnt.size();
+    for (size_t i = 0; i < learnt.size(); ++i)
+    {
+        size_t bytes = learnt[i].first.size() + learnt[i].second.size() + 64; //64 for the tree node
+        if (m_bytes + bytes > MAX_BYTES)
+        {
+            m_names.clear();
+            m_bytes = 0;
+        }
+        if (m_names.insert(learnt[i]).second)
+            m_bytes += bytes;
+    }
+}
+
+void NameMemo::PrintStats()
+{
+    MutexLock lock(&m_mutex);
+    unsigned total = m_hits + m_misses;
+    std::cout << "Name memo: " << m_hits << " hits, " << m_misses << " misses";
+    if (total)
+        std::cout << " (" << m_hits * 100 / total << "% hits)";
+    std::cout << ", " << m_bytes / 1024 << " KiB in " << m_names.size() << " names" << std::endl;
+}
+
+class FileLister : public Lister
+{
+public:
+    FileLister(int id, const std::string &title, const std::string &root)
+        :Lister(id), m_title(title), m_root(root), m_recursive(false), m_hideEmpty(false), m_cwd("/"), m_gen(0)
+    {
+        g_mutex_init(&m_mutex);
+    }
+    ~FileLister()
+    {
+        CloseDirs();
+        g_mutex_clear(&m_mutex);
+    }
+    //Show all the files under the directory as a flat list, see ListRecursive()
+    void SetRecursive(bool recursive)
+    { m_recursive = recursive; }
+    //Hide the subdirectories without media anywhere below them, see PruneDir()
+    void SetHideEmpty(bool hideEmpty)
+    { m_hideEmpty = hideEmpty; }
+    virtual bool DependsOnSubtree() const
+    { return m_recursive || m_hideEmpty; }
+    virtual bool IsRecursive() const
+    { return m_recursive; }
+
+    std::string Title()
+    {
+        std::string res = m_title;
+        if (!res.empty())
+           res += ": ";
+        res += m_cwd;
+        return res;
+    }
+    std::string Root()
+    { return m_root; }
+    virtual void ChangePath(const DirEntry &entry);
+    virtual void ChangePath(const std::string &path);
+    virtual bool Back(std::string &prev);
+    virtual void ReleaseDirs();
+    virtual void ListDir(DirSink &sink);
+    virtual std::string ActualFile(const DirEntry &entry)
+    {
+        MutexLock lock(&m_mutex);
+        std::string fullPath = CurrentPath();
+        if (fullPath != "/")
+            fullPath += "/";
+        fullPath += entry.fileName;
+        return fullPath;
+    }
+    virtual std::string WatchPath()
+    {
+        MutexLock lock(&m_mutex);
+        return CurrentPath();
+    }
+    virtual bool BeginPrefetch(const DirEntry &entry, PrefetchTarget &target);
+    virtual bool BeginWarmUp(int depth, PrefetchTarget &target);
+    virtual void PrefetchDir(const PrefetchTarget &target, DirSink &sink);
+    virtual bool BeginPrune(PrefetchTarget &target);
+    virtual void PruneDir(const PrefetchTarget &target, DirSink &sink);
+    virtual bool SavePath(std::string &path)
+    {
+        path = m_cwd;
+        return true;
+    }
+    //The directories are opened by path when they are listed
+    virtual bool RestorePath(const std::string &path)
+    {
+        ChangePath(path);
+        return true;
+    }
+    virtual bool RebuildEntry(const std::string &name, bool isDir, uint32_t mtime, uint64_t size, DirEntry &entry);
+    virtual bool ListEntry(const std::string &name, DirEntry &entry);
+private:
+    std::string m_title, m_root;
+    bool m_recursive, m_hideEmpty;
+    NameMemo m_nameMemo; //has its own lock
+
+    //These are changed from the main loop, and read also by the listing thread,
+    //so they are protected by m_mutex. Only the main loop closes the fds.
+    GMutex m_mutex;
+    std::string m_cwd; //relative to m_root
+    unsigned m_gen; //changes with m_cwd, so that a listing abandoned does not keep its directory
+    //The open directories, from the first one listed by path to the deepest one listed,
+    //each one below the previous one and all of them leading to m_cwd.
+    //Listing a directory opens it relative to the deepest one and keeps it, and going back
+    //closes it, so no path is walked again. If empty, the directories are opened by path.
+    struct KeptDir
+    {
+        std::string cwd;
+        int fd;
+        std::string path; //of fd, as the kernel saw it when it was last listed
+    };
+    std::vector<KeptDir> m_dirs;
+
+    //m_mutex must be locked for these
+    int DirFd() const; //of m_cwd, or -1 if not open yet
+    void CloseDirs();
+    std::string CurrentPath() const;
+    void KeepDir(unsigned gen, const std::string &cwd, int fd, const std::string &path);
+    static bool FdPath(int fd, std::string &path);
+    static bool RelativePath(const std::string &dir, const std::string &cwd, std::string &rel);
+    void ListDirFd(int fd, const std::string &path, DirSink &sink, bool background);
+    void PrefetchAt(int parentFd, const std::string &name, const std::string &path, int depth, DirSink &sink);
+
+    enum FileType { T_Other, T_Dir, T_File };
+    static FileType DTypeToType(unsigned char dtype);
+    static FileType ModeToType(mode_t mode);
+    static FileType StatType(const std::string &path, EntryStat &st);
+    static FileType StatTypeAt(int dirFd, const char *name, EntryStat &st);
+    //dispName, if not NULL, is the display name known from before
+    bool MakeEntry(const char *name, FileType type, const EntryStat *st, DirEntry &entry, const std::string *dispName = NULL);
+
+    //The entries read from the directory are classified by MakeEntry() in chunks.
+    //In a big directory the chunks are classified in parallel by the ClassifyPool()
+    //while the directory is still being read, and then sent to the sink in order.
+    //The first chunk is small and classified right away, so that something is shown soon.
+    //So are the next ones up to INLINE_CHUNKS: until the directory has proven big, the listing
+    //thread would only wait for the pool at the end. With one processor there is no pool.
+    //The pool takes the chunks of the foreground listings before those of the background.
+    enum { FIRST_CHUNK = 64, CHUNK_SIZE = 1024, INLINE_CHUNKS = 4, MAX_CLASSIFY_THREADS = 8 };
+    struct Output;
+    struct Chunk
+    {
+        FileLister *lister;
+        Output *out;
+        gint seq; //for the order in the pool
+        struct Raw
+        {
+            size_t name; //offset in names
+            FileType type;
+            bool hasStat;
+            EntryStat st;
+        };
+        std::string names; //NUL separated
+        std::vector<Raw> raws;
+        EntryList files;
+        bool done; //protected by out->mutex
+        Chunk(FileLister *l, Output *o)
+            :lister(l), out(o), seq(0), done(false)
+        {}
+    };
+    //Where the entries of a listing go
+    struct Output
+    {
+        DirSink &sink;
+        EntryList files; //a copy for the cache
+        Chunk *chunk; //being filled
+        std::deque<Chunk*> queued; //sent to the pool, in the order of the directory
+        size_t chunkSize; //of the one being filled
+        size_t sent; //chunks sent so far
+        bool background; //a prefetch or warm-up
+        bool prune; //hide the subdirectories known to have no media
+        dev_t dev; //of the directory, for the media index
+        GMutex mutex;
+        GCond cond; //signaled when a chunk is done
+        Output(DirSink &s)
+            :sink(s), chunk(NULL), chunkSize(FIRST_CHUNK), sent(0), background(false), prune(false), dev(0)
+        {
+            g_mutex_init(&mutex);
+            g_cond_init(&cond);
+        }
+        ~Output()
+        {
+            g_cond_clear(&cond);
+            g_mutex_clear(&mutex);
+        }
+    };
+    void AddEntry(const char *name, FileType type, const EntryStat *st, Output &out);
+    void SendChunk(Output &out);
+    void ClassifyChunk(Chunk &chunk);
+    void EmitChunks(Output &out, bool wait);
+    void FinishOutput(Output &out);
+    static GThreadPool *ClassifyPool();
+    static GThreadPool *NewClassifyPool();
+    static void ClassifyFunc(gpointer data, gpointer user);
+    static gint CompareChunks(gconstpointer a, gconstpointer b, gpointer user);
+    static volatile gint s_chunkSeq;
+    void AddStatBatch(StatBatch &stats, Output &out);
+    void ReadDirFd(int fd, Output &out);
+#ifdef RCLAUNCHER_BENCHMARK
+    void ReadDirLegacy(const std::string &realPath, Output &out);
 #endif
-    gtk_widget_set_can_focus(m_draw, TRUE);
-    MIGTK_WIDGET_key_press_event(m_draw, MainWnd, OnDrawKey, this);
-    gtk_container_add(m_wnd, m_draw);
 
-    if (g_fullscreen)
-        gtk_window_fullscreen(m_wnd);
+    //The recursive listing walks the tree with several threads that take the pending
+    //directories from a shared stack, so that the deepest ones, and those of the same
+    //branch, are read first. The entries are sent to the sink by the listing thread.
+    enum { MAX_WALK_THREADS = 8 };
+    struct Walk
+    {
+        FileLister *lister;
+        DirSink &sink;
+        int rootFd;
+        GMutex mutex;
+        GCond cond; //signaled when there are new directories or entries, or the walk ends
+        //These are protected by mutex
+        std::vector<std::string> pending; //directories to read, relative to rootFd
+        int busy; //threads reading a directory
+        EntryList found; //not sent to the sink yet
+        std::set<std::pair<dev_t, ino_t> > visited; //against symlink loops
+        Walk(FileLister *l, DirSink &s, int fd)
+            :lister(l), sink(s), rootFd(fd), busy(0)
+        {
+            g_mutex_init(&mutex);
+            g_cond_init(&cond);
+        }
+        ~Walk()
+        {
+            g_cond_clear(&cond);
+            g_mutex_clear(&mutex);
+        }
+        bool Finished() const //mutex must be locked
+        { return busy == 0 && pending.empty(); }
+    };
+    void ListRecursive(int fd, DirSink &sink);
+    static gpointer WalkFunc(gpointer data);
+    void WalkDir(Walk &walk, const std::string &rel, EntryList &files, std::vector<std::string> &subdirs);
+    bool MakeWalkEntry(const std::string &rel, const char *name, const EntryStat *st, DirEntry &entry);
+    //relName is the path of the file relative to the top directory
+    bool MakeWalkEntry(const std::string &relName, const EntryStat *st, DirEntry &entry);
+
+    enum { PRUNE_FLUSH_MS = 100 };
+    //The directories being scanned for media, from the top one down, against symlink loops
+    struct MediaScan
+    {
+        DirSink &sink;
+        std::vector<std::pair<dev_t, ino_t> > chain;
+        MediaScan(DirSink &s)
+            :sink(s)
+        {}
+    };
+    bool HasMedia(int fd, const std::string &path, MediaScan &scan, bool &cached);
+    bool AddMediaStats(StatBatch &stats, std::vector<std::string> &subdirs);
+};
+
+FileLister g_defaultLister(0, "", "/");
+
+struct IDirWatch
+{
+    //Called from the main loop. name is empty if the event is about the watched directory itself.
+    //If mask has IN_IGNORED the watch is already gone.
+    virtual void OnDirEvent(int wd, uint32_t mask, const char *name) =0;
+};
+
+//A shared inotify instance. Several clients may watch the same directory.
+//AddWatch() and RemoveWatch() can be called from any thread, but the events are
+//delivered from the main loop.
+class DirWatcher
+{
+public:
+    DirWatcher();
+    ~DirWatcher();
+    int AddWatch(const std::string &path, uint32_t mask, IDirWatch *cli); //returns -1 on error
+    void RemoveWatch(int wd, IDirWatch *cli);
+private:
+    GMutex m_mutex;
+    int m_fd;
+    GIOChannelPtr m_io;
+    typedef std::multimap<int, IDirWatch*> clients_t;
+    clients_t m_clients;
+
+    gboolean OnIo(GIOChannel *io, GIOCondition cond);
+};
+
+DirWatcher::DirWatcher()
+    :m_fd(-1)
+{
+    g_mutex_init(&m_mutex);
+}
+
+DirWatcher::~DirWatcher()
+{
+    if (m_fd != -1)
+        close(m_fd);
+    g_mutex_clear(&m_mutex);
+}
+
+int DirWatcher::AddWatch(const std::string &path, uint32_t mask, IDirWatch *cli)
+{
+    int fd;
+    {
+        MutexLock lock(&m_mutex);
+        if (m_fd == -1)
+        {
+            //Created lazily, so that nothing is done if no one needs it
+            m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (m_fd == -1)
+                return -1;
+            m_io.Reset( g_io_channel_unix_new(m_fd) );
+            g_io_channel_set_raw_nonblock(m_io, NULL);
+            MIGLIB_IO_ADD_WATCH(m_io, G_IO_IN, DirWatcher, OnIo, this);
+        }
+        fd = m_fd;
+    }
+    //Unlocked, as in a dead mount it may block, and the main loop needs the lock for the events.
+    //IN_MASK_ADD, or else we would overwrite the mask of other clients of the same directory
+    int wd = inotify_add_watch(fd, path.c_str(), mask | IN_MASK_ADD | IN_ONLYDIR);
+    if (wd == -1)
+        return -1;
+    MutexLock lock(&m_mutex);
+    m_clients.insert(std::make_pair(wd, cli));
+    return wd;
+}
+
+void DirWatcher::RemoveWatch(int wd, IDirWatch *cli)
+{
+    MutexLock lock(&m_mutex);
+    std::pair<clients_t::iterator, clients_t::iterator> range = m_clients.equal_range(wd);
+    for (clients_t::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == cli)
+        {
+            m_clients.erase(it);
+            break;
+        }
+    }
+    if (m_clients.count(wd) == 0)
+        inotify_rm_watch(m_fd, wd);
+}
+
+gboolean DirWatcher::OnIo(GIOChannel *io, GIOCondition cond)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;)
+    {
+        ssize_t len = read(m_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (char *ptr = buf; ptr < buf + len; )
+        {
+            const inotify_event *evt = reinterpret_cast<const inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + evt->len;
+
+            //Clients may call RemoveWatch() from the callback, so copy them first
+            std::vector<IDirWatch*> clis;
+            {
+                MutexLock lock(&m_mutex);
+                std::pair<clients_t::iterator, clients_t::iterator> range = m_clients.equal_range(evt->wd);
+                for (clients_t::iterator it = range.first; it != range.second; ++it)
+                    clis.push_back(it->second);
+                if (evt->mask & IN_IGNORED)
+                    m_clients.erase(range.first, range.second);
+            }
+            const char *name = evt->len? evt->name : "";
+            for (size_t i = 0; i < clis.size(); ++i)
+                clis[i]->OnDirEvent(evt->wd, evt->mask, name);
+        }
+    }
+    return TRUE;
+}
+
+DirWatcher g_dirWatcher;
+
+//An LRU cache of sorted directory listings. An item is valid as long as the
+//directory is not modified: it is keyed by the mtime and invalidated as soon
+//as inotify reports a change.
+class ListingCache : private IDirWatch
+{
+public:
+    struct Key
+    {
+        const Lister *lister; //the assocs and name transformations are part of the result
+        SortMode sort; //and so are the sort keys
+        bool metadata;
+        dev_t dev;
+        ino_t ino;
+        time_t mtime;
+        long mtimeNsec;
+
+        Key()
+            :lister(NULL), sort(SORT_NAME), metadata(false), dev(0), ino(0), mtime(0), mtimeNsec(0)
+        {}
+        Key(const Lister *l, const struct stat &st)
+            :lister(l), sort(l->GetSortMode()), metadata(l->WantsMetadata()),
+            dev(st.st_dev), ino(st.st_ino), mtime(st.st_mtim.tv_sec), mtimeNsec(st.st_mtim.tv_nsec)
+        {}
+        bool operator < (const Key &o) const
+        {
+            if (lister != o.lister)
+                return lister < o.lister;
+            if (sort != o.sort)
+                return sort < o.sort;
+            if (metadata != o.metadata)
+                return metadata < o.metadata;
+            if (dev != o.dev)
+                return dev < o.dev;
+            if (ino != o.ino)
+                return ino < o.ino;
+            if (mtime != o.mtime)
+                return mtime < o.mtime;
+            return mtimeNsec < o.mtimeNsec;
+        }
+    };
+
+    ListingCache(size_t maxBytes);
+    ~ListingCache();
+    //They return false if the key is not found
+    bool Lookup(const Key &key, EntryList &files);
+    bool Contains(const Key &key);
+    //The names of the subdirectories of a listing, without ..
+    bool SubDirs(const Key &key, std::vector<std::string> &names);
+    void Insert(const Key &key, const std::string &path, const EntryList &files);
+    //A size of 0 disables the cache
+    void SetMaxBytes(size_t maxBytes);
+private:
+    struct Item
+    {
+        Key key;
+        int wd;
+        size_t bytes;
+        EntryList files;
+    };
+    //Most recently used first
+    typedef std::list<Item> items_t;
+    typedef std::map<Key, items_t::iterator> index_t;
+
+    GMutex m_mutex;
+    items_t m_items;
+    index_t m_index;
+    size_t m_bytes, m_maxBytes;
+    unsigned m_hits, m_misses;
+
+    void Evict(items_t::iterator it);
+    virtual void OnDirEvent(int wd, uint32_t mask, const char *name);
+};
+
+ListingCache::ListingCache(size_t maxBytes)
+    :m_bytes(0), m_maxBytes(maxBytes), m_hits(0), m_misses(0)
+{
+    g_mutex_init(&m_mutex);
+}
+
+ListingCache::~ListingCache()
+{
+    g_mutex_clear(&m_mutex);
+}
+
+bool ListingCache::Lookup(const Key &key, EntryList &files)
+{
+    MutexLock lock(&m_mutex);
+    index_t::iterator it = m_index.find(key);
+    bool found = it != m_index.end();
+    if (found)
+    {
+        ++m_hits;
+        m_items.splice(m_items.begin(), m_items, it->second);
+        files = it->second->files;
+    }
+    else
+        ++m_misses;
+
+    if (g_verbose)
+        std::cout << "Listing cache: " << m_hits << " hits, " << m_misses << " misses, " << m_bytes / 1024 << " KiB in " << m_items.size() << " dirs" << std::endl;
+    return found;
+}
+
+//Does not count as a hit nor as a use
+bool ListingCache::Contains(const Key &key)
+{
+    MutexLock lock(&m_mutex);
+    return m_index.find(key) != m_index.end();
+}
+
+//Does not count as a hit nor as a use either
+bool ListingCache::SubDirs(const Key &key, std::vector<std::string> &names)
+{
+    MutexLock lock(&m_mutex);
+    index_t::iterator it = m_index.find(key);
+    if (it == m_index.end())
+        return false;
+    const EntryList &files = it->second->files;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        EntryView entry = files[i];
+        if (entry.IsDir() && strcmp(entry.FileName(), "..") != 0)
+            names.push_back(entry.FileName());
+    }
+    return true;
+}
+
+void ListingCache::Insert(const Key &key, const std::string &path, const EntryList &files)
+{
+    size_t bytes = sizeof(Item) + files.Bytes();
+    if (bytes > m_maxBytes)
+        return;
+
+    {
+        MutexLock lock(&m_mutex);
+        if (m_index.find(key) != m_index.end())
+            return;
+    }
+    //Unlocked, as in a dead mount it may block, and the main loop needs the lock for the events.
+    //A change from now on gives the directory another key, so it is not lost.
+    int wd = g_dirWatcher.AddWatch(path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF, this);
+    if (wd == -1)
+        return;
+
+    MutexLock lock(&m_mutex);
+    if (m_index.find(key) != m_index.end())
+    {
+        //Another thread was faster
+        g_dirWatcher.RemoveWatch(wd, this);
+        return;
+    }
+    m_items.push_front(Item());
+    Item &item = m_items.front();
+    item.key = key;
+    item.wd = wd;
+    item.bytes = bytes;
+    item.files = files;
+    m_index[key] = m_items.begin();
+    m_bytes += bytes;
+
+    while (m_bytes > m_maxBytes)
+        Evict(--m_items.end());
+}
+
+void ListingCache::SetMaxBytes(size_t maxBytes)
+{
+    MutexLock lock(&m_mutex);
+    m_maxBytes = maxBytes;
+    while (m_bytes > m_maxBytes)
+        Evict(--m_items.end());
+}
+
+//m_mutex must be locked
+void ListingCache::Evict(items_t::iterator it)
+{
+    g_dirWatcher.RemoveWatch(it->wd, this);
+    m_bytes -= it->bytes;
+    m_index.erase(it->key);
+    m_items.erase(it);
+}
+
+void ListingCache::OnDirEvent(int wd, uint32_t mask, const char *name)
+{
+    MutexLock lock(&m_mutex);
+    for (items_t::iterator it = m_items.begin(); it != m_items.end(); )
+    {
+        items_t::iterator cur = it++;
+        if (cur->wd != wd)
+            continue;
+        if (mask & IN_IGNORED)
+        {   //the watch is already removed
+            m_bytes -= cur->bytes;
+            m_index.erase(cur->key);
+            m_items.erase(cur);
+        }
+        else
+            Evict(cur);
+    }
+}
+
+ListingCache g_listCache(32 * 1024 * 1024);
+
+struct IMediaClient
+{
+    //Called from the main loop when some directory of lister may have changed its state
+    virtual void OnMediaChanged(const Lister *lister) =0;
+};
+
+//Remembers which directories have files of a lister somewhere below them, for the listers
+//that hide the empty ones. An item is valid while the directory keeps its mtime and inotify
+//reports no change in it. A directory without media depends on all its subdirectories, and
+//one with media on the subdirectory where it was found, so these are items too, linked to
+//their parents, and a change drops the item and every item above it. A directory may have
+//several parents, through symlinks, so every one where it was seen is kept.
+class MediaIndex : private IDirWatch
+{
+public:
+    struct Key
+    {
+        const Lister *lister; //the assocs decide what is media
+        dev_t dev;
+        ino_t ino;
+
+        Key(const Lister *l, dev_t d, ino_t i)
+            :lister(l), dev(d), ino(i)
+        {}
+        bool operator < (const Key &o) const
+        {
+            if (lister != o.lister)
+                return lister < o.lister;
+            if (dev != o.dev)
+                return dev < o.dev;
+            return ino < o.ino;
+        }
+    };
+
+    MediaIndex();
+    ~MediaIndex();
+    void SetClient(IMediaClient *cli)
+    { m_client = cli; }
+    //Only true if the directory is known to have no media
+    bool IsEmpty(const Key &key);
+    //Returns false if not known. A known item is linked to parent too, if not NULL.
+    bool Lookup(const Key &key, const struct stat &st, const Key *parent, bool &media);
+    //Anything dropped after Generation() was taken may have been used by the scan, so if
+    //that happens the result is not inserted. Returns false if not inserted.
+    unsigned Generation();
+    bool Insert(const Key &key, const struct stat &st, const Key *parent, const std::string &path, bool media, unsigned generation);
+private:
+    //Every item holds an inotify watch, and those are a limited resource
+    enum { MAX_ITEMS = 16384 };
+    struct Item
+    {
+        bool media;
+        time_t mtime;
+        long mtimeNsec;
+        int wd;
+        std::set<Key> parents;
+        Item()
+            :media(false), mtime(0), mtimeNsec(0), wd(-1)
+        {}
+    };
+    typedef std::map<Key, Item> items_t;
+
+    GMutex m_mutex;
+    items_t m_items;
+    std::multimap<int, Key> m_watches;
+    unsigned m_generation;
+    IMediaClient *m_client;
+
+    void Drop(const Key &key, std::set<const Lister*> &changed);
+    virtual void OnDirEvent(int wd, uint32_t mask, const char *name);
+};
+
+MediaIndex::MediaIndex()
+    :m_generation(0), m_client(NULL)
+{
+    g_mutex_init(&m_mutex);
+}
+
+MediaIndex::~MediaIndex()
+{
+    g_mutex_clear(&m_mutex);
+}
+
+bool MediaIndex::IsEmpty(const Key &key)
+{
+    MutexLock lock(&m_mutex);
+    items_t::iterator it = m_items.find(key);
+    return it != m_items.end() && !it->second.media;
+}
+
+bool MediaIndex::Lookup(const Key &key, const struct stat &st, const Key *parent, bool &media)
+{
+    MutexLock lock(&m_mutex);
+    items_t::iterator it = m_items.find(key);
+    if (it == m_items.end())
+        return false;
+    Item &item = it->second;
+    //inotify does not see the changes made by other hosts to a network filesystem
+    if (item.mtime != st.st_mtim.tv_sec || item.mtimeNsec != st.st_mtim.tv_nsec)
+    {
+        std::set<const Lister*> changed;
+        Drop(key, changed);
+        return false;
+    }
+    if (parent)
+        item.parents.insert(*parent);
+    media = item.media;
+    return true;
+}
+
+unsigned MediaIndex::Generation()
+{
+    MutexLock lock(&m_mutex);
+    return m_generation;
+}
+
+bool MediaIndex::Insert(const Key &key, const struct stat &st, const Key *parent, const std::string &path, bool media, unsigned generation)
+{
+    {
+        MutexLock lock(&m_mutex);
+        if (generation != m_generation || m_items.size() >= MAX_ITEMS)
+            return false;
+        if (m_items.find(key) != m_items.end())
+            return true;
+    }
+    //Unlocked, as in a dead mount it may block, and the main loop needs the lock for the events
+    int wd = g_dirWatcher.AddWatch(path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF, this);
+    if (wd == -1)
+        return false;
+
+    MutexLock lock(&m_mutex);
+    //Anything dropped meanwhile may have been based on what this was
+    bool raced = m_items.find(key) != m_items.end();
+    if (raced || generation != m_generation || m_items.size() >= MAX_ITEMS)
+    {
+        g_dirWatcher.RemoveWatch(wd, this);
+        return raced;
+    }
+    Item &item = m_items[key];
+    item.media = media;
+    item.mtime = st.st_mtim.tv_sec;
+    item.mtimeNsec = st.st_mtim.tv_nsec;
+    item.wd = wd;
+    if (parent)
+        item.parents.insert(*parent);
+    m_watches.insert(std::make_pair(wd, key));
+    return true;
+}
+
+//m_mutex must be locked
+void MediaIndex::Drop(const Key &key, std::set<const Lister*> &changed)
+{
+    items_t::iterator it = m_items.find(key);
+    if (it == m_items.end())
+        return;
+    Item item = it->second;
+    m_items.erase(it);
+    ++m_generation;
+    changed.insert(key.lister);
+
+    if (item.wd != -1)
+    {
+        std::pair<std::multimap<int, Key>::iterator, std::multimap<int, Key>::iterator> range = m_watches.equal_range(item.wd);
+        for (std::multimap<int, Key>::iterator w = range.first; w != range.second; ++w)
+        {
+            if (!(w->second < key) && !(key < w->second))
+            {
+                m_watches.erase(w);
+                break;
+            }
+        }
+        g_dirWatcher.RemoveWatch(item.wd, this);
+    }
+    for (std::set<Key>::const_iterator p = item.parents.begin(); p != item.parents.end(); ++p)
+        Drop(*p, changed);
+}
+
+void MediaIndex::OnDirEvent(int wd, uint32_t mask, const char *name)
+{
+    std::set<const Lister*> changed;
+    IMediaClient *cli;
+    {
+        MutexLock lock(&m_mutex);
+        std::vector<Key> keys;
+        std::pair<std::multimap<int, Key>::iterator, std::multimap<int, Key>::iterator> range = m_watches.equal_range(wd);
+        for (std::multimap<int, Key>::iterator w = range.first; w != range.second; ++w)
+            keys.push_back(w->second);
+        if (mask & IN_IGNORED)
+        {   //the watch is already removed
+            m_watches.erase(range.first, range.second);
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                items_t::iterator it = m_items.find(keys[i]);
+                if (it != m_items.end())
+                    it->second.wd = -1;
+            }
+        }
+        for (size_t i = 0; i < keys.size(); ++i)
+            Drop(keys[i], changed);
+        cli = m_client;
+    }
+    if (!cli)
+        return;
+    for (std::set<const Lister*>::iterator it = changed.begin(); it != changed.end(); ++it)
+        cli->OnMediaChanged(*it);
+}
+
+MediaIndex g_mediaIndex;
+
+void FileLister::ChangePath(const DirEntry &entry)
+{
+    MutexLock lock(&m_mutex);
+    if (m_cwd == "/")
+        m_cwd.clear(); //to avoid the double /
+    m_cwd = m_cwd + "/" + entry.fileName;
+    ++m_gen;
+}
+void FileLister::ChangePath(const std::string &path)
+{
+    MutexLock lock(&m_mutex);
+    m_cwd = path;
+    ++m_gen;
+    CloseDirs();
+}
+
+void FileLister::ReleaseDirs()
+{
+    MutexLock lock(&m_mutex);
+    ++m_gen;
+    CloseDirs();
+}
+
+bool FileLister::Back(std::string &prev)
+{
+    MutexLock lock(&m_mutex);
+    if (m_cwd == "/")
+        return false;
+    prev = BaseName(m_cwd);
+    m_cwd = DirName(m_cwd);
+    ++m_gen;
+    std::string rel;
+    while (!m_dirs.empty() && !RelativePath(m_dirs.back().cwd, m_cwd, rel))
+    {
+        close(m_dirs.back().fd);
+        m_dirs.pop_back();
+    }
+    return true;
+}
+
+int FileLister::DirFd() const
+{
+    return !m_dirs.empty() && m_dirs.back().cwd == m_cwd? m_dirs.back().fd : -1;
+}
+
+void FileLister::CloseDirs()
+{
+    for (size_t i = 0; i < m_dirs.size(); ++i)
+        close(m_dirs[i].fd);
+    m_dirs.clear();
+}
+
+//Keeps a copy of fd, just opened by the listing thread for cwd, if the lister has not moved
+//since the listing started. path is where fd is now, or empty if unknown.
+void FileLister::KeepDir(unsigned gen, const std::string &cwd, int fd, const std::string &path)
+{
+    std::string rel;
+    if (gen != m_gen)
+        return;
+    if (!m_dirs.empty() && m_dirs.back().cwd == cwd)
+    {
+        //Listed again, maybe after a rename: the kept parents moved with it
+        if (path.empty() || path == m_dirs.back().path)
+            return;
+        m_dirs.back().path = path;
+        for (size_t i = 0; i + 1 < m_dirs.size(); ++i)
+        {
+            KeptDir &dir = m_dirs[i];
+            if (RelativePath(dir.cwd, cwd, rel) && path.size() > rel.size() &&
+                    path.compare(path.size() - rel.size(), rel.size(), rel) == 0 && path[path.size() - rel.size() - 1] == '/')
+                dir.path = path.size() == rel.size() + 1? "/" : path.substr(0, path.size() - rel.size() - 1);
+        }
+        return;
+    }
+    if (path.empty() || (!m_dirs.empty() && !RelativePath(m_dirs.back().cwd, cwd, rel)))
+        return;
+    KeptDir dir;
+    dir.cwd = cwd;
+    dir.path = path;
+    dir.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dir.fd != -1)
+        m_dirs.push_back(dir);
+}
+
+//The path of fd, as the kernel sees it now. Fails if it has been deleted.
+/*static*/bool FileLister::FdPath(int fd, std::string &path)
+{
+    char link[64], buf[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, buf, sizeof(buf) - 1);
+    static const char deleted[] = " (deleted)";
+    const size_t deletedLen = sizeof(deleted) - 1;
+    if (len <= 0 || buf[0] != '/' ||
+            (static_cast<size_t>(len) >= deletedLen && memcmp(buf + len - deletedLen, deleted, deletedLen) == 0))
+        return false;
+    path.assign(buf, len);
+    return true;
+}
+
+//If cwd is dir or below it, sets rel to its path relative to dir
+/*static*/bool FileLister::RelativePath(const std::string &dir, const std::string &cwd, std::string &rel)
+{
+    if (cwd == dir)
+    {
+        rel = ".";
+        return true;
+    }
+    size_t len = dir == "/"? 0 : dir.size();
+    if (cwd.size() <= len + 1 || cwd.compare(0, len, dir, 0, len) != 0 || cwd[len] != '/')
+        return false;
+    rel = cwd.substr(len + 1);
+    return true;
+}
+
+//The path of the current directory, as the kernel saw it when the deepest kept one
+//was last listed, so it is right even if a parent has been renamed before that
+std::string FileLister::CurrentPath() const
+{
+    std::string rel;
+    if (!m_dirs.empty() && RelativePath(m_dirs.back().cwd, m_cwd, rel))
+    {
+        std::string res = m_dirs.back().path;
+        if (rel != ".")
+        {
+            if (res != "/")
+                res += "/";
+            res += rel;
+        }
+        return res;
+    }
+    return m_root + m_cwd;
+}
+
+void FileLister::ListDir(DirSink &sink)
+{
+    //Taken now, as the lister may move on if this listing is abandoned
+    std::string cwd, realPath, path, rel;
+    unsigned gen;
+    OpenFd base;
+    {
+        MutexLock lock(&m_mutex);
+        gen = m_gen;
+        cwd = m_cwd;
+        realPath = m_root + m_cwd;
+        path = CurrentPath();
+        if (!m_dirs.empty() && RelativePath(m_dirs.back().cwd, cwd, rel))
+            base.Reset(fcntl(m_dirs.back().fd, F_DUPFD_CLOEXEC, 0));
+    }
+    if (realPath != "/" && realPath != "//")
+        sink.Add(DirEntry("..", "..", NULL, true));
+
+    //Opened here and not when changing to it, as in a dead mount it blocks.
+    //A new fd even for the deepest one, as reading moves the offset.
+    OpenFd fd(base != -1?
+            openat(base, rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+            open(realPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+    //Read here, so that the main loop does not have to
+    std::string fdPath;
+    if (FdPath(fd, fdPath))
+        path = fdPath;
+    {
+        MutexLock lock(&m_mutex);
+        KeepDir(gen, cwd, fd, fdPath);
+    }
+    //The listing cache only knows about changes in the directory itself
+    if (m_recursive)
+        ListRecursive(fd, sink);
+    else
+        ListDirFd(fd, path, sink, false);
+}
+
+//Lists the directory fd, whose path is path, through the listing cache
+void FileLister::ListDirFd(int fd, const std::string &path, DirSink &sink, bool background)
+{
+    ListingCache::Key key;
+    struct stat stDir;
+    bool statOk = fstat(fd, &stDir) == 0;
+    //The subdirectories may gain or lose their media without touching this one
+    bool cacheable = statOk && !m_hideEmpty;
+    if (cacheable)
+    {
+        key = ListingCache::Key(this, stDir);
+        EntryList cached;
+        //A background listing has checked the cache already, and it must not count in its stats
+        if (!background && g_listCache.Lookup(key, cached))
+        {
+            for (size_t i = 0; i < cached.size(); ++i)
+                sink.Add(cached, i);
+            return;
+        }
+    }
+    //Besides sending them to the sink, keep a copy of the entries for the cache
+    Output out(sink);
+    out.background = background;
+    if (statOk && m_hideEmpty)
+    {
+        out.prune = true;
+        out.dev = stDir.st_dev;
+    }
+#ifdef RCLAUNCHER_BENCHMARK
+    if (g_statByPath)
+        ReadDirLegacy(path, out);
+    else
+#endif
+        ReadDirFd(fd, out);
+    FinishOutput(out);
+
+    if (g_verbose && HasNameTransforms() && TransformsWhileListing())
+        m_nameMemo.PrintStats();
+    if (out.files.Full() && g_verbose)
+        std::cout << "Too many files in " << path << " to keep them in the listing cache" << std::endl;
+    if (cacheable && !sink.IsCancelled() && !out.files.Full())
+    {
+        out.files.Sort(NULL);
+        g_listCache.Insert(key, path, out.files);
+    }
+}
+
+bool FileLister::BeginPrefetch(const DirEntry &entry, PrefetchTarget &target)
+{
+    //Those listings do not go to the cache
+    if (!entry.isDir || entry.fileName == ".." || DependsOnSubtree())
+        return false;
+    MutexLock lock(&m_mutex);
+    target.path = CurrentPath();
+    if (target.path != "/")
+        target.path += "/";
+    target.path += entry.fileName;
+    if (g_mountHealth.IsStalled(target.path))
+        return false;
+    target.lister = this;
+    target.name = entry.fileName;
+    target.parentFd.Reset(DirFd() != -1? fcntl(DirFd(), F_DUPFD_CLOEXEC, 0) : -1);
+    return true;
+}
+
+bool FileLister::BeginWarmUp(int depth, PrefetchTarget &target)
+{
+    if (DependsOnSubtree())
+        return false;
+    target.path = m_root.empty()? "/" : m_root;
+    if (g_mountHealth.IsStalled(target.path))
+        return false;
+    target.lister = this;
+    target.depth = depth;
+    return true;
+}
+
+void FileLister::PrefetchDir(const PrefetchTarget &target, DirSink &sink)
+{
+    PrefetchAt(target.parentFd, target.name, target.path, target.depth, sink);
+}
+
+//Lists name in parentFd, or path if parentFd is -1, and depth levels of its subdirectories
+void FileLister::PrefetchAt(int parentFd, const std::string &name, const std::string &path, int depth, DirSink &sink)
+{
+    OpenFd fd(parentFd != -1?
+            openat(parentFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+            open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    sink.CountIo(1);
+    if (fd == -1)
+        return;
+    struct stat stDir;
+    if (fstat(fd, &stDir) != 0)
+        return;
+    ListingCache::Key key(this, stDir);
+    //Already there, nothing to do
+    if (!g_listCache.Contains(key))
+        ListDirFd(fd, path, sink, true);
+    if (depth <= 0 || sink.IsCancelled())
+        return;
+
+    std::vector<std::string> subdirs;
+    if (!g_listCache.SubDirs(key, subdirs))
+        return;
+    for (size_t i = 0; i < subdirs.size() && !sink.IsCancelled(); ++i)
+    {
+        std::string sub = path;
+        if (sub != "/")
+            sub += "/";
+        sub += subdirs[i];
+        PrefetchAt(fd, subdirs[i], sub, depth - 1, sink);
+    }
+}
+
+bool FileLister::BeginPrune(PrefetchTarget &target)
+{
+    if (!m_hideEmpty || m_recursive)
+        return false;
+    MutexLock lock(&m_mutex);
+    target.path = CurrentPath();
+    if (g_mountHealth.IsStalled(target.path))
+        return false;
+    target.lister = this;
+    target.name = ".";
+    target.parentFd.Reset(DirFd() != -1? fcntl(DirFd(), F_DUPFD_CLOEXEC, 0) : -1);
+    return true;
+}
+
+void FileLister::PruneDir(const PrefetchTarget &target, DirSink &sink)
+{
+    OpenFd fd(target.parentFd != -1?
+            openat(target.parentFd, target.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+            open(target.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+    std::vector<std::string> subdirs;
+    {
+        OpenDir dir(OpenDirFd(fd));
+        while (dirent *de = dir? readdir(dir) : NULL)
+        {
+            const char *name = de->d_name;
+            unsigned char dtype = DirentType(de);
+            if (sink.IsCancelled())
+                return;
+            if (name[0] == '.') //hidden folder, or . and ..
+                continue;
+            if (dtype == DT_DIR || dtype == DT_UNKNOWN || dtype == DT_LNK || g_ignoreDType)
+                subdirs.push_back(name);
+        }
+    }
+    MediaScan scan(sink);
+    DirEntry entry;
+    //The changes are sent in batches, but not kept for long
+    gint64 nextFlush = 0;
+    for (size_t i = 0; i < subdirs.size() && !sink.IsCancelled(); ++i)
+    {
+        const std::string &subdir = subdirs[i];
+        const char *name = subdir.c_str();
+        EntryStat st;
+        if (StatTypeAt(fd, name, st) != T_Dir)
+            continue;
+        OpenFd sub(openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (sub == -1)
+            continue;
+        std::string path = target.path;
+        if (path != "/")
+            path += "/";
+        path += subdir;
+        bool cached;
+        bool media = HasMedia(sub, path, scan, cached);
+        if (sink.IsCancelled())
+            return;
+        if (media == (target.shown.count(subdir) != 0) || !MakeEntry(name, T_Dir, &st, entry))
+            continue;
+        if (media)
+            sink.Add(entry);
+        else
+            sink.Remove(entry);
+        gint64 now = g_get_monotonic_time();
+        if (now >= nextFlush)
+        {
+            sink.Flush();
+            nextFlush = now + PRUNE_FLUSH_MS * G_TIME_SPAN_MILLISECOND;
+        }
+    }
+}
+
+//Whether the directory fd, whose path is path, or any directory below it, has a file to show.
+//The files are checked before the subdirectories, so that the scan ends soon if there is one.
+//The result is taken from the media index or else put there, but only if everything it is based
+//on is there too, so that a change anywhere drops it; then cached is true.
+bool FileLister::HasMedia(int fd, const std::string &path, MediaScan &scan, bool &cached)
+{
+    cached = false;
+    struct stat stDir;
+    if (fstat(fd, &stDir) != 0)
+        return false;
+    std::pair<dev_t, ino_t> id(stDir.st_dev, stDir.st_ino);
+    if (std::find(scan.chain.begin(), scan.chain.end(), id) != scan.chain.end())
+        return false; //a symlink loop, there is nothing new there
+    MediaIndex::Key key(this, stDir.st_dev, stDir.st_ino);
+    MediaIndex::Key parent(this, 0, 0);
+    if (!scan.chain.empty())
+        parent = MediaIndex::Key(this, scan.chain.back().first, scan.chain.back().second);
+    const MediaIndex::Key *parentKey = scan.chain.empty()? NULL : &parent;
+    bool media = false;
+    if (g_mediaIndex.Lookup(key, stDir, parentKey, media))
+    {
+        cached = true;
+        return media;
+    }
+    unsigned generation = g_mediaIndex.Generation();
+
+    std::vector<std::string> subdirs;
+    {
+        OpenDir dir(OpenDirFd(fd));
+        StatBatch stats(fd);
+        while (dirent *de = dir? readdir(dir) : NULL)
+        {
+            const char *name = de->d_name;
+            unsigned char dtype = DirentType(de);
+            ino_t ino = de->d_ino;
+            if (scan.sink.IsCancelled())
+                return true;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            if (dtype == DT_DIR && !g_ignoreDType)
+            {
+                if (name[0] != '.') //hidden folder
+                    subdirs.push_back(name);
+            }
+            else if (dtype == DT_REG && !g_ignoreDType)
+            {
+                if (Match(name))
+                {
+                    media = true;
+                    break;
+                }
+            }
+            else
+            {
+                stats.Add(name, ino);
+                if (stats.Size() >= StatBatch::MAX_BATCH && AddMediaStats(stats, subdirs))
+                {
+                    media = true;
+                    break;
+                }
+            }
+        }
+        //A big directory without d_type is stat'ed in batches, so that a cancel is seen between them
+        if (!media && !scan.sink.IsCancelled())
+            media = AddMediaStats(stats, subdirs);
+    }
+
+    //With media it depends only on where it was found, without media on all the subdirectories
+    bool complete = true;
+    scan.chain.push_back(id);
+    for (size_t i = 0; i < subdirs.size() && !media && !scan.sink.IsCancelled(); ++i)
+    {
+        OpenFd sub(openat(fd, subdirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        if (sub == -1)
+        {   //it may have media, and nothing would drop the result when it can be read
+            complete = false;
+            continue;
+        }
+        std::string subPath = path;
+        if (subPath != "/")
+            subPath += "/";
+        subPath += subdirs[i];
+        bool subCached;
+        media = HasMedia(sub, subPath, scan, subCached);
+        if (media)
+            complete = subCached;
+        else
+            complete = complete && subCached;
+    }
+    scan.chain.pop_back();
+    //A partial scan proves nothing
+    if (scan.sink.IsCancelled())
+        return true;
+    if (complete)
+        cached = g_mediaIndex.Insert(key, stDir, parentKey, path, media, generation);
+    return media;
+}
+
+//Stats the batch for HasMedia(): returns true if there is a file to show, or else adds the subdirectories
+bool FileLister::AddMediaStats(StatBatch &stats, std::vector<std::string> &subdirs)
+{
+    stats.Run();
+    bool media = false;
+    for (size_t i = 0; i < stats.Size() && !media; ++i)
+    {
+        const EntryStat &st = stats.Stat(i);
+        FileType type = st.ok? ModeToType(st.mode) : T_Other;
+        const char *name = stats.Name(i);
+        if (type == T_Dir && name[0] != '.')
+            subdirs.push_back(name);
+        else if (type == T_File && Match(name))
+            media = true;
+    }
+    stats.Clear();
+    return media;
+}
+
+//Reads the directory relative to its fd, so no path strings are built.
+//The entries without a d_type, or all of them if the metadata is needed,
+//are stat'ed in batches.
+void FileLister::ReadDirFd(int fd, Output &out)
+{
+    OpenDir dir(OpenDirFd(fd));
+    StatBatch stats(fd);
+    bool metadata = WantsMetadata();
+    size_t read = 0;
+    while (dirent *de = dir? readdir(dir) : NULL)
+    {
+        const char *name = de->d_name;
+        unsigned char dtype = DirentType(de);
+        ino_t ino = de->d_ino;
+        if (read++ % PrefetchTarget::READ_ENTRIES == 0)
+            out.sink.CountIo(1);
+        if (out.sink.IsCancelled())
+            return;
+
+        if (dtype != DT_UNKNOWN && dtype != DT_LNK && !g_ignoreDType && !metadata)
+        {
+            if (dtype == DT_DIR && out.prune && g_mediaIndex.IsEmpty(MediaIndex::Key(this, out.dev, ino)))
+                continue;
+            AddEntry(name, DTypeToType(dtype), NULL, out);
+        }
+        else
+        {
+            stats.Add(name, ino);
+            if (stats.Size() >= StatBatch::MAX_BATCH)
+                AddStatBatch(stats, out);
+        }
+    }
+    if (!out.sink.IsCancelled())
+        AddStatBatch(stats, out);
+}
+
+void FileLister::AddStatBatch(StatBatch &stats, Output &out)
+{
+    //Before, so that a batch over the budget is not run
+    out.sink.CountIo(stats.Size());
+    if (out.sink.IsCancelled())
+    {
+        stats.Clear();
+        return;
+    }
+    stats.Run();
+    for (size_t i = 0; i < stats.Size(); ++i)
+    {
+        const EntryStat &st = stats.Stat(i);
+        FileType type = st.ok? ModeToType(st.mode) : T_Other;
+        //A symlink has the inode of the link, not of the directory, so it is left to PruneDir()
+        if (type == T_Dir && out.prune && g_mediaIndex.IsEmpty(MediaIndex::Key(this, out.dev, stats.Inode(i))))
+            continue;
+        AddEntry(stats.Name(i), type, &st, out);
+    }
+    stats.Clear();
+}
+
+void FileLister::AddEntry(const char *name, FileType type, const EntryStat *st, Output &out)
+{
+    if (!out.chunk)
+        out.chunk = new Chunk(this, &out);
+    Chunk::Raw raw;
+    raw.name = out.chunk->names.size();
+    raw.type = type;
+    raw.hasStat = st != NULL;
+    if (st)
+        raw.st = *st;
+    out.chunk->names.append(name, strlen(name) + 1);
+    out.chunk->raws.push_back(raw);
+    if (out.chunk->raws.size() >= out.chunkSize)
+        SendChunk(out);
+}
+
+//Without a pool, or if it is one of the first INLINE_CHUNKS, the chunk is classified right here
+void FileLister::SendChunk(Output &out)
+{
+    Chunk *chunk = out.chunk;
+    out.chunk = NULL;
+    bool first = out.sent == 0;
+    out.chunkSize = CHUNK_SIZE;
+    GThreadPool *pool = out.sent++ < INLINE_CHUNKS? NULL : ClassifyPool();
+    if (pool)
+    {
+        chunk->seq = g_atomic_int_add(&s_chunkSeq, 1);
+        out.queued.push_back(chunk);
+        g_thread_pool_push(pool, chunk, NULL);
+    }
+    else
+    {
+        ClassifyChunk(*chunk);
+        chunk->done = true;
+        out.queued.push_back(chunk);
+    }
+    EmitChunks(out, false);
+    //Even if MakeEntry() dropped some, do not wait for the next chunk to show them
+    if (first)
+        out.sink.Flush();
+}
+
+void FileLister::ClassifyChunk(Chunk &chunk)
+{
+    //The display names known from before, all at once
+    bool memo = HasNameTransforms() && TransformsWhileListing();
+    std::vector<const char*> names;
+    std::vector<std::string> disp;
+    std::vector<char> known;
+    if (memo)
+    {
+        names.resize(chunk.raws.size());
+        for (size_t i = 0; i < chunk.raws.size(); ++i)
+            names[i] = chunk.names.c_str() + chunk.raws[i].name;
+        m_nameMemo.Lookup(names, disp, known);
+    }
+    std::vector<std::pair<std::string, std::string> > learnt;
+
+    DirEntry entry; //reused, so that its strings keep their capacity
+    for (size_t i = 0; i < chunk.raws.size() && !chunk.out->sink.IsCancelled(); ++i)
+    {
+        const Chunk::Raw &raw = chunk.raws[i];
+        const std::string *dispName = memo && known[i]? &disp[i] : NULL;
+        if (MakeEntry(chunk.names.c_str() + raw.name, raw.type, raw.hasStat? &raw.st : NULL, entry, dispName))
+        {
+            if (memo && !dispName && !entry.isDir)
+                learnt.push_back(std::make_pair(entry.fileName, entry.dispName));
+            chunk.files.push_back(entry);
+        }
+    }
+    m_nameMemo.Insert(learnt);
+}
+
+/*static*/void FileLister::ClassifyFunc(gpointer data, gpointer user)
+{
+    Chunk *chunk = static_cast<Chunk*>(data);
+    chunk->lister->ClassifyChunk(*chunk);
+    MutexLock lock(&chunk->out->mutex);
+    chunk->done = true;
+    g_cond_broadcast(&chunk->out->cond);
+}
+
+//Sends the classified chunks to the sink, in order, until one that is not done.
+//If wait, until all of them are sent.
+void FileLister::EmitChunks(Output &out, bool wait)
+{
+    while (!out.queued.empty())
+    {
+        Chunk *chunk = out.queued.front();
+        {
+            MutexLock lock(&out.mutex);
+            while (!chunk->done)
+            {
+                if (!wait)
+                    return;
+                g_cond_wait(&out.cond, &out.mutex);
+            }
+        }
+        out.queued.pop_front();
+        for (size_t i = 0; i < chunk->files.size() && !out.sink.IsCancelled(); ++i)
+        {
+            out.files.push_back(chunk->files, i);
+            out.sink.Add(chunk->files, i);
+        }
+        delete chunk;
+    }
+}
+
+//Even if cancelled, it waits for the chunks in the pool, as they point to out
+void FileLister::FinishOutput(Output &out)
+{
+    if (out.chunk)
+    {
+        //A small directory is not worth the threads
+        if (out.queued.empty())
+        {
+            ClassifyChunk(*out.chunk);
+            out.chunk->done = true;
+            out.queued.push_back(out.chunk);
+            out.chunk = NULL;
+        }
+        else
+            SendChunk(out);
+    }
+    EmitChunks(out, true);
+}
+
+//Shared by all the listings, NULL if there is a single processor
+/*static*/GThreadPool *FileLister::ClassifyPool()
+{
+    if (!g_parallelClassify)
+        return NULL;
+    //Initialized only once, even if several listings start at the same time
+    static GThreadPool *pool = NewClassifyPool();
+    return pool;
+}
+
+/*static*/GThreadPool *FileLister::NewClassifyPool()
+{
+    int threads = std::min<int>(g_get_num_processors(), MAX_CLASSIFY_THREADS);
+    if (threads < 2)
+        return NULL;
+    GThreadPool *pool = g_thread_pool_new(ClassifyFunc, NULL, threads, FALSE, NULL);
+    if (pool)
+        g_thread_pool_set_sort_function(pool, CompareChunks, NULL);
+    return pool;
+}
+
+volatile gint FileLister::s_chunkSeq = 0;
+
+//The foreground first, and then in the order they were sent
+/*static*/gint FileLister::CompareChunks(gconstpointer a, gconstpointer b, gpointer user)
+{
+    const Chunk *ca = static_cast<const Chunk*>(a), *cb = static_cast<const Chunk*>(b);
+    if (ca->out->background != cb->out->background)
+        return ca->out->background? 1 : -1;
+    //The difference, and not a comparison, so that it works when the counter wraps around
+    gint diff = static_cast<gint>(static_cast<guint>(ca->seq) - static_cast<guint>(cb->seq));
+    return diff < 0? -1 : diff > 0? 1 : 0;
+}
+
+#ifdef RCLAUNCHER_BENCHMARK
+void FileLister::ReadDirLegacy(const std::string &realPath, Output &out)
+{
+    OpenDir dir(realPath);
+    if (!dir)
+        return;
+
+    while (dirent *entry = readdir(dir))
+    {
+        if (out.sink.IsCancelled())
+            return;
+
+        FileType type;
+        EntryStat st, *pst = NULL;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK && !g_ignoreDType && !WantsMetadata())
+            type = DTypeToType(entry->d_type);
+        else
+#endif
+        {
+            type = StatType(realPath + "/" + entry->d_name, st);
+            pst = &st;
+        }
+
+        AddEntry(entry->d_name, type, pst, out);
+    }
+}
+#endif
+
+/*static*/FileLister::FileType FileLister::DTypeToType(unsigned char dtype)
+{
+    return dtype == DT_DIR? T_Dir : 
+           dtype == DT_REG? T_File : 
+           T_Other;
+}
+
+/*static*/FileLister::FileType FileLister::ModeToType(mode_t mode)
+{
+    return S_ISDIR(mode)? T_Dir : 
+           S_ISREG(mode)? T_File : 
+           T_Other;
+}
+
+/*static*/FileLister::FileType FileLister::StatType(const std::string &path, EntryStat &st)
+{
+    return StatTypeAt(AT_FDCWD, path.c_str(), st);
+}
+
+/*static*/FileLister::FileType FileLister::StatTypeAt(int dirFd, const char *name, EntryStat &st)
+{
+    struct stat s;
+    if (fstatat(dirFd, name, &s, 0) != 0)
+        return T_Other;
+    st.ok = true;
+    st.mode = s.st_mode;
+    st.mtime = s.st_mtime;
+    st.size = s.st_size;
+    return ModeToType(s.st_mode);
+}
+
+//st may be NULL if the metadata is not needed
+bool FileLister::MakeEntry(const char *name, FileType type, const EntryStat *st, DirEntry &entry, const std::string *dispName)
+{
+    if (!*name)
+        return false;
+    //if (name[0] == '.')
+    //    return false; //hidden?
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return false;
+
+    //Build the strings only for the entries that are actually shown
+    if (type == T_Dir)
+    {
+        if (name[0] == '.')
+            return false; //hidden folder
+        entry.fileName = name;
+        entry.dispName = entry.fileName;
+        entry.isDir = true;
+        entry.lazyName = false;
+        entry.nameReady = true;
+        entry.assoc = NULL;
+        entry.SetMetadata(st? *st : EntryStat());
+        entry.MakeSortKey(GetSortMode());
+        return true;
+    }
+    else if (type == T_File)
+    {
+        FileAssoc *assoc = Match(name);
+        if (assoc)
+        {
+            entry.fileName = name;
+            entry.isDir = false;
+            if (HasNameTransforms() && !TransformsWhileListing())
+            {
+                entry.dispName = entry.fileName;
+                entry.lazyName = true;
+                entry.nameReady = false;
+            }
+            else
+            {
+                //Most names are usually left as they are, and those need no transformation
+                if (dispName)
+                    entry.dispName = *dispName;
+                else if (!HasNameTransforms() || !TransformIfChanges(entry.fileName, entry.dispName))
+                    entry.dispName = entry.fileName;
+                entry.lazyName = false;
+                entry.nameReady = true;
+            }
+            entry.assoc = assoc;
+            entry.SetMetadata(st? *st : EntryStat());
+            entry.MakeSortKey(GetSortMode());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FileLister::ListEntry(const std::string &name, DirEntry &entry)
+{
+    int dirFd;
+    {
+        MutexLock lock(&m_mutex);
+        dirFd = DirFd();
+    }
+    //Only the main loop closes it
+    EntryStat st;
+    FileType type = dirFd != -1?
+        StatTypeAt(dirFd, name.c_str(), st) :
+        StatType(m_root + m_cwd + "/" + name, st);
+    //A new subdirectory needs a walk of its own, that is left to the caller
+    if (m_recursive)
+        return type == T_File && MakeWalkEntry(name, &st, entry);
+    return MakeEntry(name.c_str(), type, &st, entry);
+}
+
+bool FileLister::RebuildEntry(const std::string &name, bool isDir, uint32_t mtime, uint64_t size, DirEntry &entry)
+{
+    EntryStat st;
+    st.ok = true;
+    st.mode = isDir? S_IFDIR : S_IFREG;
+    st.mtime = mtime;
+    st.size = size;
+    if (!m_recursive)
+        return MakeEntry(name.c_str(), isDir? T_Dir : T_File, &st, entry);
+    return !isDir && MakeWalkEntry(name, &st, entry);
+}
+
+//Lists every file under the directory fd, with a path relative to it
+void FileLister::ListRecursive(int fd, DirSink &sink)
+{
+    Walk walk(this, sink, fd);
+    walk.pending.push_back("");
+
+    //Reading directories waits mostly on the disk, so use more threads than processors
+    int nThreads = std::max(2, std::min<int>(2 * g_get_num_processors(), MAX_WALK_THREADS));
+    std::vector<GThread*> threads;
+    for (int i = 0; i < nThreads; ++i)
+        threads.push_back(g_thread_new("rclauncher-walk", WalkFunc, &walk));
+
+    EntryList batch;
+    for (;;)
+    {
+        bool finished;
+        {
+            MutexLock lock(&walk.mutex);
+            //With a timeout, to notice the cancellation
+            if (walk.found.empty() && !walk.Finished())
+                g_cond_wait_until(&walk.cond, &walk.mutex, g_get_monotonic_time() + 100 * G_TIME_SPAN_MILLISECOND);
+            batch.swap(walk.found);
+            finished = walk.Finished();
+        }
+        for (size_t i = 0; i < batch.size() && !sink.IsCancelled(); ++i)
+            sink.Add(batch, i);
+        batch.clear();
+        if (finished || sink.IsCancelled())
+            break;
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        g_thread_join(threads[i]);
+}
+
+/*static*/gpointer FileLister::WalkFunc(gpointer data)
+{
+    Walk &walk = *static_cast<Walk*>(data);
+    EntryList files;
+    std::vector<std::string> subdirs;
+    MutexLock lock(&walk.mutex);
+    for (;;)
+    {
+        //With a timeout, to notice the cancellation
+        while (walk.pending.empty() && walk.busy > 0 && !walk.sink.IsCancelled())
+            g_cond_wait_until(&walk.cond, &walk.mutex, g_get_monotonic_time() + 100 * G_TIME_SPAN_MILLISECOND);
+        if (walk.pending.empty() || walk.sink.IsCancelled())
+            break;
+        std::string rel;
+        rel.swap(walk.pending.back());
+        walk.pending.pop_back();
+        ++walk.busy;
+
+        g_mutex_unlock(&walk.mutex);
+        walk.lister->WalkDir(walk, rel, files, subdirs);
+        g_mutex_lock(&walk.mutex);
+
+        walk.found.append(files);
+        files.clear();
+        walk.pending.insert(walk.pending.end(), subdirs.begin(), subdirs.end());
+        subdirs.clear();
+        --walk.busy;
+        g_cond_broadcast(&walk.cond);
+    }
+    return NULL;
+}
+
+//Reads the directory rel: the files that are shown go to files and the subdirectories to subdirs
+void FileLister::WalkDir(Walk &walk, const std::string &rel, EntryList &files, std::vector<std::string> &subdirs)
+{
+    OpenFd fd(openat(walk.rootFd, rel.empty()? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    struct stat stDir;
+    if (fd == -1 || fstat(fd, &stDir) != 0)
+        return;
+    {
+        MutexLock lock(&walk.mutex);
+        if (!walk.visited.insert(std::make_pair(stDir.st_dev, stDir.st_ino)).second)
+            return;
+    }
+    //Before reading it, so that no change is lost
+    if (!rel.empty())
+        walk.sink.EnterSubDir(rel);
+    std::string prefix = rel.empty()? rel : rel + "/";
+
+    OpenDir dir(OpenDirFd(fd));
+    StatBatch stats(fd);
+    bool metadata = WantsMetadata();
+    DirEntry entry; //reused, so that its strings keep their capacity
+    while (dirent *de = dir? readdir(dir) : NULL)
+    {
+        const char *name = de->d_name;
+        unsigned char dtype = DirentType(de);
+        ino_t ino = de->d_ino;
+        if (walk.sink.IsCancelled())
+            return;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        if (dtype == DT_DIR && !g_ignoreDType)
+        {
+            if (name[0] != '.') //hidden folder
+                subdirs.push_back(prefix + name);
+        }
+        else if (dtype == DT_REG && !g_ignoreDType && !metadata)
+        {
+            if (MakeWalkEntry(rel, name, NULL, entry))
+                files.push_back(entry);
+        }
+        else
+            stats.Add(name, ino);
+    }
+
+    stats.Run();
+    for (size_t i = 0; i < stats.Size(); ++i)
+    {
+        const EntryStat &st = stats.Stat(i);
+        FileType type = st.ok? ModeToType(st.mode) : T_Other;
+        const char *name = stats.Name(i);
+        if (type == T_Dir)
+        {
+            if (name[0] != '.')
+                subdirs.push_back(prefix + name);
+        }
+        else if (type == T_File && MakeWalkEntry(rel, name, &st, entry))
+            files.push_back(entry);
+    }
+}
+
+//The entry of a file of the directory rel. The file name is the relative path and the display
+//name is rel and then the transformed name, built right now, as the transformations only know names.
+bool FileLister::MakeWalkEntry(const std::string &rel, const char *name, const EntryStat *st, DirEntry &entry)
+{
+    FileAssoc *assoc = Match(name);
+    if (!assoc)
+        return false;
+    entry.fileName.clear();
+    if (!rel.empty())
+    {
+        entry.fileName = rel;
+        entry.fileName += '/';
+    }
+    size_t nameStart = entry.fileName.size();
+    entry.fileName += name;
+    TransformName(entry.fileName.substr(nameStart), entry.dispName);
+    entry.dispName.insert(0, entry.fileName, 0, nameStart);
+    entry.isDir = false;
+    entry.lazyName = false;
+    entry.nameReady = true;
+    entry.assoc = assoc;
+    entry.SetMetadata(st? *st : EntryStat());
+    entry.MakeSortKey(GetSortMode());
+    return true;
+}
+
+bool FileLister::MakeWalkEntry(const std::string &relName, const EntryStat *st, DirEntry &entry)
+{
+    size_t slash = relName.rfind('/');
+    if (slash == std::string::npos)
+        return MakeWalkEntry("", relName.c_str(), st, entry);
+    return MakeWalkEntry(relName.substr(0, slash), relName.c_str() + slash + 1, st, entry);
+}
+
+class OpenedFileLister : public Lister
+{
+public:
+    OpenedFileLister(int id, const std::string &title)
+        :Lister(id), m_title(title)
+    {}
+    virtual std::string Title() 
+    { return m_title; }
+    virtual std::string Root()
+    { return ""; }
+    virtual bool Back(std::string &prev)
+    { return false; }
+    virtual void ChangePath(const DirEntry &entry)
+    {}
+    virtual void ChangePath(const std::string &path)
+    {}
+    virtual void ListDir(DirSink &sink);
+    virtual std::string ActualFile(const DirEntry &entry)
+    { return entry.fileName; }
+private:
+    std::string m_title;
+};
+
+void OpenedFileLister::ListDir(DirSink &sink)
+{
+    OpenDir proc("/proc");
+    if (!proc)
+        return;
+    while (dirent *eproc = readdir(proc))
+    {
+        if (sink.IsCancelled())
+            return;
+        char *end;
+        (void)(strtol(eproc->d_name, &end, 10) == 0); //to avoid the warn_unused_result
+        if (*end) //not an integer
+            continue;
+        std::string path = "/proc/";
+        path += eproc->d_name;
+        path += "/fd";
+
+        OpenDir fd(path);
+        if (!fd)
+            continue;
+        while (dirent *efd = readdir(fd))
+        {
+            std::string s = path + "/" + efd->d_name;
+            char target[100];
+            int len = readlink(s.c_str(), target, sizeof(target) - 1);
+            if (len < 0)
+                continue;
+            target[len] = 0;
+            const char *slash = strrchr(target, '/');
+            if (slash)
+            {
+                ++slash;
+                const char *end = strchr(slash, ' '); //sometimes ' (deleted)' is added to the filename
+                if (!end)
+                    end = slash + strlen(slash);
+                std::string base(slash, end);
+                FileAssoc *assoc = Match(base.c_str());
+                if (!assoc)
+                    continue;
+                DirEntry entry(base, s, assoc, false, GetSortMode());
+                if (WantsMetadata())
+                {
+                    //The link is followed, so this is the open file even if it has been deleted
+                    struct stat st;
+                    EntryStat est;
+                    if (stat(s.c_str(), &st) == 0)
+                    {
+                        est.ok = true;
+                        est.mode = st.st_mode;
+                        est.mtime = st.st_mtime;
+                        est.size = st.st_size;
+                    }
+                    entry.SetMetadata(est);
+                    entry.MakeSortKey(GetSortMode());
+                }
+                sink.Add(entry);
+            }
+        }
+    }
+}
+
+class AmuleLister : public Lister
+{
+public:
+    AmuleLister(int id, const std::string &root)
+        :Lister(id), m_root(root)
+    {}
+    virtual std::string Title() 
+    { return "aMule"; }
+    virtual std::string Root()
+    { return ""; }
+    virtual bool Back(std::string &prev)
+    { return false; }
+    virtual void ChangePath(const DirEntry &entry)
+    {}
+    virtual void ChangePath(const std::string &path)
+    {}
+    virtual void ListDir(DirSink &sink);
+    virtual std::string ActualFile(const DirEntry &entry)
+    { return entry.fileName; }
+private:
+    std::string m_root;
+
+    void ReadMetFile(const char *metName, DirSink &sink);
+};
+
+void AmuleLister::ListDir(DirSink &sink)
+{
+    OpenFd fd(open(m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0)
+        return;
+
+    //Only the *.met files matter, so filter by name before stat'ing anything
+    OpenDir dir(OpenDirFd(fd));
+    StatBatch stats(fd);
+    while (dirent *de = dir? readdir(dir) : NULL)
+    {
+        const char *name = de->d_name;
+        unsigned char dtype = DirentType(de);
+        ino_t ino = de->d_ino;
+        if (sink.IsCancelled())
+            return;
+        size_t len = strlen(name);
+        if (len < 4 || strcmp(name + len - 4, ".met") != 0)
+            continue;
+        if (dtype != DT_UNKNOWN && dtype != DT_LNK && !g_ignoreDType)
+        {
+            if (dtype == DT_REG)
+                ReadMetFile(name, sink);
+        }
+        else
+            stats.Add(name, ino);
+    }
+
+    stats.Run();
+    for (size_t i = 0; i < stats.Size(); ++i)
+    {
+        if (sink.IsCancelled())
+            return;
+        const EntryStat &st = stats.Stat(i);
+        if (st.ok && S_ISREG(st.mode))
+            ReadMetFile(stats.Name(i), sink);
+    }
+}
+
+void AmuleLister::ReadMetFile(const char *metName, DirSink &sink)
+{
+    std::ifstream ifs((m_root + "/" + metName).c_str(), std::ios::binary);
+    //g_print("File: %s\n", metName);
+    uint8_t version;
+    ifs.read((char*)&version, 1);
+    if (version != 0xE0)
+        return;
+    //The date is the mtime of the .part file when the .met was written
+    uint32_t date;
+    ifs.read((char*)&date, 4);
+    ifs.ignore(16); //hash
+    uint16_t parts;
+    ifs.read((char*)&parts, 2);
+    ifs.ignore(parts * 16); //hashes
+    uint32_t tags;
+    ifs.read((char*)&tags, 4);
+    //The name is all that is needed, but for the metadata the size of the
+    //whole file, which is in a later tag
+    std::string name;
+    EntryStat st;
+    st.mtime = date;
+    bool done = false;
+    for (uint32_t i = 0; i < tags && !done && ifs; ++i)
+    {
+        uint8_t type, uname;
+        ifs.read((char*)&type, 1);
+        if (type & 0x80)
+        {
+            type &= 0x7F;
+            ifs.read((char*)&uname, 1);
+	}
+        else
+        {
+            uint16_t len;
+            ifs.read((char*)&len, 2);
+            if (len == 1)
+                ifs.read((char*)&uname, 1);
+            else
+            {
+                uname = 0xFF;
+                ifs.ignore(len);
+            }
+        }
+        switch (type)
+        {
+        case 1: //HASH16
+            ifs.ignore(16);
+            break;
+        case 2: //STRING
+            {
+                uint16_t slen;
+                ifs.read((char*)&slen, 2);
+                std::vector<char> s(slen + 1);
+                ifs.read(s.data(), slen);
+                //g_print("\t%d: '%s'\n", uname, s.data());
+                if (uname == 1) //filename
+                {
+                    name = s.data();
+                    done = !WantsMetadata() || st.ok;
+                }
+            }
+            break;
+        case 3: //UINT32
+            if (uname == 2) //filesize
+            {
+                uint32_t size;
+                ifs.read((char*)&size, 4);
+                st.size = size;
+                st.ok = true;
+                done = !name.empty();
+            }
+            else
+                ifs.ignore(4);
+            break;
+        case 4: //FLOAT32
+            ifs.ignore(4);
+            break;
+        case 5: //BOOL
+            ifs.ignore(1);
+            break;
+        case 11://UINT64
+            if (uname == 2) //filesize
+            {
+                uint64_t size;
+                ifs.read((char*)&size, 8);
+                st.size = size;
+                st.ok = true;
+                done = !name.empty();
+            }
+            else
+                ifs.ignore(8);
+            break;
+        case 8: //UINT16
+            ifs.ignore(2);
+            break;
+        case 9: //UINT8
+            ifs.ignore(1);
+            break;
+        case 6: //BOOLARRAY
+            //TODO
+        case 7: //BLOB
+            //TODO
+        case 10://BSOB
+            //TODO
+        default:
+            done = true;
+            break;
+        }
+    }
+    if (name.empty())
+        return;
+    FileAssoc *assoc = Match(name.c_str());
+    if (!assoc)
+        return;
+    DirEntry entry(name, m_root + "/" + std::string(metName, strlen(metName) - 4), assoc, false, GetSortMode());
+    if (WantsMetadata())
+    {
+        entry.SetMetadata(st);
+        entry.MakeSortKey(GetSortMode());
+    }
+    sink.Add(entry);
+}
+
+struct GraphicOptions
+{
+    std::string descFont, descFontTitle, descFontQueue;
+    struct Color
+    {
+        double r, g, b;
+
+        void set_source(cairo_t *cr)
+        {
+            cairo_set_source_rgb(cr, r, g, b);
+        }
+    };
+    Color colorFg, colorFgQ, colorBg, colorScroll;
+
+    GraphicOptions()
+    {
+        descFont = "Sans 24";
+        descFontTitle = "Sans Bold 40";
+        descFontQueue = "Sans 16";
+        colorFg.r = colorFg.g = colorFg.b = 1;
+        colorFgQ.r = colorFgQ.g = 1; colorFgQ.b = 0.5;
+        colorBg.r = colorBg.g = colorBg.b = 0;
+        colorScroll.r = colorScroll.g = colorScroll.b = 0.75;
+    }
+};
+
+struct Options
+{
+    GraphicOptions gr;
+    std::vector<FileAssoc*> assocs;
+    std::vector<NameTrans*> nameTrans;
+    std::vector<Lister*> favorites;
+    int listTimeout; //seconds without progress before a listing is given up, 0 to wait forever
+    int warmUp; //levels of the favorites listed in the background at startup, 0 for none
+
+    Options()
+        :listTimeout(10), warmUp(1)
+    {}
+    ~Options()
+    {
+        for (size_t i = 0; i < assocs.size(); ++i)
+            delete assocs[i];
+        for (size_t i = 0; i < nameTrans.size(); ++i)
+            delete nameTrans[i];
+        for (size_t i = 0; i < favorites.size(); ++i)
+            delete favorites[i];
+    }
+} g_options;
+
+/*static*/FileAssoc *FileAssoc::MatchGlobal(const char *file)
+{
+    return FileAssoc::Match(g_options.assocs, file);
+}
+/*static*/FileAssoc *FileAssoc::Match(const std::vector<FileAssoc*> &assocs, const char *file)
+{
+    bool isGlobal = &g_options.assocs == &assocs;
+
+    //If no associations are defined use the default
+    if (!isGlobal && assocs.empty())
+        return MatchGlobal(file);
+
+    for (size_t i = 0; i < assocs.size(); ++i)
+    {
+        FileAssoc *assoc = assocs[i];
+        if (assoc)
+        {
+            if (regexec(assoc->regex, file, 0, NULL, 0) == REG_NOERROR)
+                return assoc;
+        }
+        else if (!isGlobal)
+        {
+            assoc = MatchGlobal(file);
+            if (assoc)
+                return assoc;
+        }
+    }
+    return NULL;
+}
+
+//A repeated association would never be the first match
+static void AddAssocOnce(std::vector<FileAssoc*> &assocs, FileAssoc *fa)
+{
+    if (std::find(assocs.begin(), assocs.end(), fa) == assocs.end())
+        assocs.push_back(fa);
+}
+
+void Lister::PrepareAssocs()
+{
+    std::vector<FileAssoc*> assocs;
+    //If no associations are defined use the default
+    const std::vector<FileAssoc*> &own = m_assocs.empty()? g_options.assocs : m_assocs;
+    for (size_t i = 0; i < own.size(); ++i)
+    {
+        if (own[i])
+            AddAssocOnce(assocs, own[i]);
+        else
+        {
+            for (size_t j = 0; j < g_options.assocs.size(); ++j)
+                AddAssocOnce(assocs, g_options.assocs[j]);
+        }
+    }
+    m_matcher.Compile(assocs);
+    if (g_verbose)
+    {
+        std::cout << "Associations of '" << Title() << "': " << m_matcher.Compiled() << " of " << assocs.size()
+            << " compiled, " << m_matcher.Extensions() << " extensions, " << m_matcher.States() << " states" << std::endl;
+    }
+}
+
+//res must not be name
+/*static*/void NameTrans::TransformName(const std::vector<NameTrans*> &trans, const std::string &name, std::string &res, size_t first)
+{
+    if (first >= trans.size())
+    {
+        res = name;
+        return;
+    }
+    //Reused by every call from the same thread, so that it keeps its capacity
+    static thread_local std::string tmp;
+
+    //Every stage reads the output of the previous one and writes into the other
+    //buffer, choosing them so that the last one writes into res
+    const std::string *src = &name;
+    for (size_t i = first; i < trans.size(); ++i)
+    {
+        std::string &dst = (trans.size() - i) % 2 == 1? res : tmp;
+        trans[i]->TransformName(*src, dst);
+        src = &dst;
+    }
+}
+
+/*static*/std::string NameTrans::TransformName(const std::vector<NameTrans*> &trans, const std::string &name)
+{
+    std::string res;
+    TransformName(trans, name, res);
+    return res;
+}
+
+/*static*/std::string NameTrans::TransformNameGlobal(const std::string &name)
+{
+    return NameTrans::TransformName(g_options.nameTrans, name);
+}
+
+/*static*/const std::vector<NameTrans*> &NameTrans::Global()
+{
+    return g_options.nameTrans;
+}
+
+/*static*/bool NameTrans::AffectsSort(const std::vector<NameTrans*> &trans)
+{
+    for (size_t i = 0; i < trans.size(); ++i)
+    {
+        if (!trans[i]->displayOnly)
+            return true;
+    }
+    return false;
+}
+
+/*static*/size_t NameTrans::FirstChange(const std::vector<NameTrans*> &trans, const char *name)
+{
+    //Until one matches, every stage reads the name itself
+    for (size_t i = 0; i < trans.size(); ++i)
+    {
+        if (regexec(trans[i]->regex, name, 0, NULL, 0) == REG_NOERROR)
+            return i;
+    }
+    return trans.size();
+}
+
+struct IListJobClient
+{
+    //These are called from the main loop
+    virtual void OnListBatch(EntryList &batch) =0;
+    //Only for a prune, see DirSink::Remove()
+    virtual void OnListRemoved(EntryList &removed)
+    {}
+    virtual void OnListDone() =0;
+};
+
+//ListJob runs Lister::ListDir() in a worker thread and sends the entries back
+//to the main loop as they are found. Before that, still in the worker, as in a dead mount
+//anything may block, it watches the directory for changes and takes its key.
+//It is finished with Stop(), that cancels the listing and never waits for the worker:
+//if it has not returned it is detached, it will not call the client anymore, and it will
+//delete the job by itself when it returns. A listing that makes no progress is given up
+//with Abandon(), that does the same and also marks its mount as stalled until it returns.
+//A prefetch job lists some directories, one after the other, at idle priority only to fill
+//the listing cache: it has no client and it gives up on a target after PrefetchTarget::MAX_IO
+//calls to the filesystem. It is used for the warm-up, and the Prefetcher for the cursor.
+//Being in the background, a prefetch or prune job says nothing about the health of the mount.
+//An entries job builds the entries of some files of the current directory with
+//Lister::ListEntry(), for the changes reported by inotify, so that they are stat'ed here.
+//A recursive listing also watches the subdirectories as they are walked, up to MAX_SUB_WATCHES.
+class ListJob : private DirSink
+{
+public:
+    //A listing known from before, to be put in the listing cache if the directory has not changed
+    struct Seed
+    {
+        ListingCache::Key key;
+        EntryList files; //sorted, without ".."
+    };
+    //Takes ownership of seed. If watch is not NULL, the directory is watched for it.
+    ListJob(Lister *lister, IListJobClient *cli, IDirWatch *watch, Seed *seed = NULL);
+    //Takes ownership of the targets. Without a client they are prefetched, and with one they
+    //are pruned, see Lister::PruneDir(), and the entries are sent to it.
+    ListJob(const std::vector<PrefetchTarget*> &targets, IListJobClient *cli = NULL);
+    ListJob(Lister *lister, IListJobClient *cli, const std::vector<std::string> &names);
+    static void Stop(ListJob *job);
+    static void Abandon(ListJob *job);
+    //Ends the listing early, but it still finishes with OnListDone()
+    void Cancel()
+    { m_cancel.Cancel(); }
+    //For the client from OnListDone(). The watch, or -1, is removed with the job unless taken.
+    int TakeWatch();
+    //The same for the watches of the subdirectories, by wd, with their relative path.
+    //wds must be empty.
+    void TakeSubWatches(std::map<int, std::string> &wds);
+    //Of the directory when it was listed, without lister if it has none
+    const ListingCache::Key &DirKey() const
+    { return m_key; }
+    //If true, some worker is still using the listers and the caches, so they cannot be destroyed
+    static bool AnyDetached()
+    { return g_atomic_int_get(&s_detached) != 0; }
+    //Makes the calling thread yield the CPU and the disk to everything else
+    static void LowerPriority();
+private:
+    Lister *m_lister;
+    IListJobClient *m_cli;
+    IDirWatch *m_watch;
+    miutil::AutoPtr<Seed> m_seed;
+    std::vector<PrefetchTarget*> m_prefetch;
+    std::vector<std::string> m_names; //for an entries job
+    GThread *m_thread;
+    CancelToken m_cancel;
+    std::string m_path; //being listed, for the mount health, empty if none or in the background
+    //Set by the worker before listing
+    int m_wd;
+    ListingCache::Key m_key;
+    //The inotify watches are limited per user, so that a big tree does not take them all.
+    //The changes in the rest of it are seen only when it is listed again.
+    enum { MAX_SUB_WATCHES = 4096 };
+    static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+    //These are protected by m_mutex
+    GMutex m_mutex;
+    std::map<int, std::string> m_subWds;
+    EntryList m_pending, m_pendingRemoved;
+    bool m_done, m_abandoned, m_stalled;
+    guint m_idle;
+    static volatile gint s_detached; //the jobs detached and still running
+
+    ~ListJob();
+    void Detach(); //m_mutex must be locked
+    static gpointer ThreadFunc(gpointer data);
+    void WatchDir();
+    void PlantSeed();
+    virtual bool IsCancelled() const
+    { return m_cancel.IsCancelled() || (!m_lister && !m_cli && IoCount() > PrefetchTarget::MAX_IO); }
+    virtual void OnBatch(EntryList &batch);
+    virtual void OnRemoved(EntryList &removed);
+    virtual void EnterSubDir(const std::string &rel);
+    void QueueIdle();
+    gboolean OnIdle();
+
+    ListJob(const ListJob &); //nocopy
+    void operator=(const ListJob &); //nocopy
+};
+
+ListJob::ListJob(Lister *lister, IListJobClient *cli, IDirWatch *watch, Seed *seed)
+    :m_lister(lister), m_cli(cli), m_watch(watch), m_seed(seed), m_thread(NULL), m_path(lister->WatchPath()), m_wd(-1), m_done(false), m_abandoned(false), m_stalled(false), m_idle(0)
+{
+    g_mutex_init(&m_mutex);
+    m_thread = g_thread_new("rclauncher-list", ThreadFunc, this);
+}
+
+ListJob::ListJob(const std::vector<PrefetchTarget*> &targets, IListJobClient *cli)
+    :m_lister(NULL), m_cli(cli), m_watch(NULL), m_prefetch(targets), m_thread(NULL), m_wd(-1), m_done(false), m_abandoned(false), m_stalled(false), m_idle(0)
+{
+    g_mutex_init(&m_mutex);
+    m_thread = g_thread_new(cli? "rclauncher-prune" : "rclauncher-prefetch", ThreadFunc, this);
+}
+
+ListJob::ListJob(Lister *lister, IListJobClient *cli, const std::vector<std::string> &names)
+    :m_lister(lister), m_cli(cli), m_watch(NULL), m_names(names), m_thread(NULL), m_wd(-1), m_done(false), m_abandoned(false), m_stalled(false), m_idle(0)
+{
+    g_mutex_init(&m_mutex);
+    m_thread = g_thread_new("rclauncher-entries", ThreadFunc, this);
+}
+
+//An abandoned job is deleted from its own thread
+ListJob::~ListJob()
+{
+    if (m_abandoned)
+        g_thread_unref(m_thread);
+    else
+        g_thread_join(m_thread);
+    //The thread is gone, so no more idles will be queued
+    if (m_idle)
+        g_source_remove(m_idle);
+    if (m_wd != -1)
+        g_dirWatcher.RemoveWatch(m_wd, m_watch);
+    for (std::map<int, std::string>::iterator it = m_subWds.begin(); it != m_subWds.end(); ++it)
+        g_dirWatcher.RemoveWatch(it->first, m_watch);
+    for (size_t i = 0; i < m_prefetch.size(); ++i)
+        delete m_prefetch[i];
+    g_mutex_clear(&m_mutex);
+}
+
+/*static*/void ListJob::Stop(ListJob *job)
+{
+    if (!job)
+        return;
+    job->m_cancel.Cancel();
+    {
+        MutexLock lock(&job->m_mutex);
+        //Even a cancelled listing may take long in a slow mount, and that is no reason to block the UI
+        if (!job->m_done)
+        {
+            job->Detach();
+            return;
+        }
+    }
+    delete job;
+}
+
+/*static*/void ListJob::Abandon(ListJob *job)
+{
+    if (!job)
+        return;
+    job->m_cancel.Cancel();
+    {
+        MutexLock lock(&job->m_mutex);
+        if (!job->m_done)
+        {
+            job->Detach();
+            //Before the worker can see m_abandoned, so that Recovered() comes later
+            if (!job->m_path.empty())
+            {
+                job->m_stalled = true;
+                g_mountHealth.Stalled(job->m_path);
+            }
+            return;
+        }
+    }
+    delete job;
+}
+
+int ListJob::TakeWatch()
+{
+    int wd = m_wd;
+    m_wd = -1;
+    return wd;
+}
+
+void ListJob::TakeSubWatches(std::map<int, std::string> &wds)
+{
+    MutexLock lock(&m_mutex);
+    wds.swap(m_subWds);
+}
+
+volatile gint ListJob::s_detached = 0;
+
+void ListJob::Detach()
+{
+    g_atomic_int_inc(&s_detached);
+    m_abandoned = true;
+    if (m_idle)
+    {
+        g_source_remove(m_idle);
+        m_idle = 0;
+    }
+}
+
+/*static*/gpointer ListJob::ThreadFunc(gpointer data)
+{
+    ListJob *that = static_cast<ListJob*>(data);
+    if (!that->m_lister)
+    {
+        LowerPriority();
+        for (size_t i = 0; i < that->m_prefetch.size() && !that->m_cancel.IsCancelled(); ++i)
+        {
+            const PrefetchTarget &target = *that->m_prefetch[i];
+            that->ResetIo();
+            if (that->m_cli)
+                target.lister->PruneDir(target, *that);
+            else
+                target.lister->PrefetchDir(target, *that);
+        }
+        if (that->m_cli && !that->IsCancelled())
+            that->Flush();
+    }
+    else if (!that->m_names.empty())
+    {
+        DirEntry entry;
+        for (size_t i = 0; i < that->m_names.size() && !that->IsCancelled(); ++i)
+        {
+            if (that->m_lister->ListEntry(that->m_names[i], entry))
+                that->Add(entry);
+        }
+        if (!that->IsCancelled())
+            that->Flush();
+    }
+    else
+    {
+        that->WatchDir();
+        if (that->m_seed)
+            that->PlantSeed();
+        that->m_lister->ListDir(*that);
+        if (!that->IsCancelled())
+            that->Flush();
+    }
+
+    bool abandoned, stalled;
+    {
+        MutexLock lock(&that->m_mutex);
+        that->m_done = true;
+        abandoned = that->m_abandoned;
+        stalled = that->m_stalled;
+        if (!abandoned && that->m_cli)
+            that->QueueIdle();
+    }
+    //If not abandoned, the main loop may delete the job at any moment now
+    if (abandoned)
+    {
+        if (stalled)
+            g_mountHealth.Recovered(that->m_path);
+        delete that;
+        g_atomic_int_add(&s_detached, -1);
+    }
+    return NULL;
+}
+
+//Watch before listing, so that no change is lost, and take the key before listing,
+//so that it is never newer than the entries
+void ListJob::WatchDir()
+{
+    if (m_path.empty())
+        return;
+    if (m_watch)
+        m_wd = g_dirWatcher.AddWatch(m_path, WATCH_MASK, m_watch);
+    struct stat st;
+    if (!m_lister->DependsOnSubtree() && stat(m_path.c_str(), &st) == 0)
+        m_key = ListingCache::Key(m_lister, st);
+}
+
+void ListJob::EnterSubDir(const std::string &rel)
+{
+    if (!m_watch || m_path.empty())
+        return;
+    {
+        MutexLock lock(&m_mutex);
+        if (m_subWds.size() >= MAX_SUB_WATCHES)
+            return;
+    }
+    //Unlocked, as in a dead mount it may block
+    std::string path = m_path;
+    if (path != "/")
+        path += "/";
+    path += rel;
+    int wd = g_dirWatcher.AddWatch(path, WATCH_MASK, m_watch);
+    if (wd == -1)
+        return;
+    MutexLock lock(&m_mutex);
+    m_subWds[wd] = rel;
+}
+
+void ListJob::PlantSeed()
+{
+    const Seed &seed = *m_seed;
+    if (m_key.lister && !(m_key < seed.key) && !(seed.key < m_key))
+        g_listCache.Insert(m_key, m_path, seed.files);
+}
+
+/*static*/void ListJob::LowerPriority()
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    //From linux/ioprio.h
+    const int IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_IDLE = 3, IOPRIO_CLASS_SHIFT = 13;
+    pid_t tid = syscall(SYS_gettid);
+    //In Linux the nice value is per thread
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0 && g_verbose)
+        perror("setpriority");
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0 && g_verbose)
+        perror("ioprio_set");
+#endif
+}
+
+void ListJob::OnBatch(EntryList &batch)
+{
+    if (!m_cli)
+    {   //the listing cache keeps its own copy
+        batch.clear();
+        return;
+    }
+    MutexLock lock(&m_mutex);
+    if (m_abandoned)
+        return;
+    if (m_pending.empty())
+        m_pending.swap(batch);
+    else
+        m_pending.append(batch);
+    QueueIdle();
+}
+
+void ListJob::OnRemoved(EntryList &removed)
+{
+    if (!m_cli)
+        return;
+    MutexLock lock(&m_mutex);
+    if (m_abandoned)
+        return;
+    m_pendingRemoved.append(removed);
+    QueueIdle();
+}
+
+//m_mutex must be locked
+void ListJob::QueueIdle()
+{
+    //The default idle priority is lower than that of the input events and the redraws,
+    //so the UI is kept responsive while the entries are being merged.
+    if (!m_idle)
+        m_idle = g_idle_add(MIGLIB_IDLE_FUNC(ListJob, OnIdle), this);
+}
+
+gboolean ListJob::OnIdle()
+{
+    EntryList batch, removed;
+    bool done;
+    {
+        MutexLock lock(&m_mutex);
+        batch.swap(m_pending);
+        removed.swap(m_pendingRemoved);
+        done = m_done;
+        m_idle = 0;
+    }
+    if (!removed.empty())
+        m_cli->OnListRemoved(removed);
+    if (!batch.empty())
+        m_cli->OnListBatch(batch);
+    //The client may delete this object from OnListDone(), so do not touch it from now on
+    if (done)
+        m_cli->OnListDone();
+    return FALSE;
+}
+
+//Prefetcher lists the directory under the cursor in the background, at idle priority,
+//only to fill the listing cache. It has a single worker thread, started with the first
+//target, that lists them one at a time: a new target replaces the one waiting and cancels
+//the one being listed, so moving the cursor over many directories starts no more threads.
+//A target is given up after PrefetchTarget::MAX_IO calls to the filesystem.
+//It is finished with Finish(), that never waits for a worker that is listing: it is
+//detached, and it deletes the prefetcher by itself when it returns.
+class Prefetcher : private DirSink
+{
+public:
+    Prefetcher();
+    //Takes ownership of the target
+    void Prefetch(PrefetchTarget *target);
+    //Drops the target waiting, and cancels the one being listed
+    void Cancel();
+    static void Finish(Prefetcher *prefetcher);
+    //If true, the worker is still using the listers and the caches
+    static bool AnyDetached()
+    { return g_atomic_int_get(&s_detached) != 0; }
+private:
+    GThread *m_thread;
+    volatile gint m_gen; //changes with every target and Cancel()
+    gint m_targetGen; //m_gen when the target being listed was taken, set by the worker
+
+    //These are protected by m_mutex
+    GMutex m_mutex;
+    GCond m_cond; //signalled when there is a target or m_quit
+    PrefetchTarget *m_next;
+    bool m_busy, m_quit, m_detached;
+    static volatile gint s_detached;
+
+    ~Prefetcher();
+    static gpointer ThreadFunc(gpointer data);
+    void Run();
+    virtual bool IsCancelled() const
+    { return g_atomic_int_get(&m_gen) != m_targetGen || IoCount() > PrefetchTarget::MAX_IO; }
+    virtual void OnBatch(EntryList &batch)
+    { batch.clear(); } //the listing cache keeps its own copy
+
+    Prefetcher(const Prefetcher &); //nocopy
+    void operator=(const Prefetcher &); //nocopy
+};
+
+volatile gint Prefetcher::s_detached = 0;
+
+Prefetcher::Prefetcher()
+    :m_thread(NULL), m_gen(0), m_targetGen(0), m_next(NULL), m_busy(false), m_quit(false), m_detached(false)
+{
+    g_mutex_init(&m_mutex);
+    g_cond_init(&m_cond);
+}
+
+//A detached prefetcher is deleted from its own thread
+Prefetcher::~Prefetcher()
+{
+    if (m_thread)
+    {
+        if (m_detached)
+            g_thread_unref(m_thread);
+        else
+            g_thread_join(m_thread);
+    }
+    delete m_next;
+    g_cond_clear(&m_cond);
+    g_mutex_clear(&m_mutex);
+}
+
+void Prefetcher::Prefetch(PrefetchTarget *target)
+{
+    {
+        MutexLock lock(&m_mutex);
+        delete m_next;
+        m_next = target;
+        g_atomic_int_inc(&m_gen);
+        g_cond_signal(&m_cond);
+    }
+    if (!m_thread)
+        m_thread = g_thread_new("rclauncher-prefetch", ThreadFunc, this);
+}
+
+void Prefetcher::Cancel()
+{
+    MutexLock lock(&m_mutex);
+    delete m_next;
+    m_next = NULL;
+    g_atomic_int_inc(&m_gen);
+}
+
+/*static*/void Prefetcher::Finish(Prefetcher *prefetcher)
+{
+    if (!prefetcher)
+        return;
+    {
+        MutexLock lock(&prefetcher->m_mutex);
+        delete prefetcher->m_next;
+        prefetcher->m_next = NULL;
+        prefetcher->m_quit = true;
+        g_atomic_int_inc(&prefetcher->m_gen);
+        g_cond_signal(&prefetcher->m_cond);
+        //Even cancelled, a listing may take long in a slow mount
+        if (prefetcher->m_busy)
+        {
+            prefetcher->m_detached = true;
+            g_atomic_int_inc(&s_detached);
+            return;
+        }
+    }
+    //The worker is waiting for a target, or not started, so it returns at once
+    delete prefetcher;
+}
+
+/*static*/gpointer Prefetcher::ThreadFunc(gpointer data)
+{
+    Prefetcher *that = static_cast<Prefetcher*>(data);
+    ListJob::LowerPriority();
+    that->Run();
+    bool detached;
+    {
+        MutexLock lock(&that->m_mutex);
+        detached = that->m_detached;
+    }
+    //If not detached, Finish() is joining this thread
+    if (detached)
+    {
+        delete that;
+        g_atomic_int_add(&s_detached, -1);
+    }
+    return NULL;
+}
+
+void Prefetcher::Run()
+{
+    g_mutex_lock(&m_mutex);
+    for (;;)
+    {
+        while (!m_next && !m_quit)
+            g_cond_wait(&m_cond, &m_mutex);
+        if (m_quit)
+            break;
+        miutil::AutoPtr<PrefetchTarget> next(m_next);
+        m_next = NULL;
+        m_busy = true;
+        m_targetGen = g_atomic_int_get(&m_gen);
+        g_mutex_unlock(&m_mutex);
+
+        ResetIo();
+        const PrefetchTarget &target = *next;
+        target.lister->PrefetchDir(target, *this);
+        Flush();
+
+        g_mutex_lock(&m_mutex);
+        m_busy = false;
+    }
+    g_mutex_unlock(&m_mutex);
+}
+
+//NavHistory remembers the directories the user has left: their listing and the position
+//of the cursor, so that going back to one of them shows it instantly. It is still listed
+//again, but if the directory has not been modified since, the listing is just the saved one.
+//If the listing was not finished, just the selected entry is remembered.
+//It is used only from the main loop.
+class NavHistory
+{
+public:
+    struct State
+    {
+        EntryList files;
+        int lineSel, firstLine;
+        std::string selected; //the file name at lineSel
+        ListingCache::Key key; //of the directory, when it was listed
+        State()
+            :lineSel(0), firstLine(0)
+        {}
+    };
+    NavHistory(size_t maxBytes)
+        :m_bytes(0), m_maxBytes(maxBytes)
+    {}
+    //Takes the contents of state. If !complete, the files are discarded.
+    void Save(Lister *lister, State &state, bool complete);
+    //Returns false if the current directory of the lister is not remembered.
+    //If state.files is empty, only the selected entry can be restored.
+    bool Restore(Lister *lister, State &state);
+private:
+    struct Item
+    {
+        Lister *lister;
+        std::string path;
+        size_t bytes;
+        State state;
+    };
+    //Most recently used first
+    typedef std::list<Item> items_t;
+    items_t m_items;
+    size_t m_bytes, m_maxBytes;
+
+    items_t::iterator Find(Lister *lister, const std::string &path);
+    void Erase(items_t::iterator it);
+};
+
+NavHistory::items_t::iterator NavHistory::Find(Lister *lister, const std::string &path)
+{
+    items_t::iterator it;
+    for (it = m_items.begin(); it != m_items.end(); ++it)
+    {
+        if (it->lister == lister && it->path == path)
+            break;
+    }
+    return it;
+}
+
+void NavHistory::Erase(items_t::iterator it)
+{
+    m_bytes -= it->bytes;
+    m_items.erase(it);
+}
+
+void NavHistory::Save(Lister *lister, State &state, bool complete)
+{
+    std::string path = lister->WatchPath();
+    if (path.empty())
+        return;
+    items_t::iterator it = Find(lister, path);
+    if (it != m_items.end())
+        Erase(it);
+
+    m_items.push_front(Item());
+    Item &item = m_items.front();
+    item.lister = lister;
+    item.path = path;
+    item.state.lineSel = state.lineSel;
+    item.state.firstLine = state.firstLine;
+    item.state.selected.swap(state.selected);
+    item.state.key = state.key;
+    if (complete)
+        item.state.files.swap(state.files);
+    item.bytes = sizeof(Item) + path.size() + item.state.selected.size() + item.state.files.Bytes();
+    m_bytes += item.bytes;
+
+    //Keep at least the newest one, although without its files if it is too big
+    while (m_bytes > m_maxBytes && m_items.size() > 1)
+        Erase(--m_items.end());
+    if (m_bytes > m_maxBytes)
+    {
+        m_bytes -= item.state.files.Bytes();
+        item.bytes -= item.state.files.Bytes();
+        EntryList().swap(item.state.files);
+    }
+}
+
+bool NavHistory::Restore(Lister *lister, State &state)
+{
+    items_t::iterator it = Find(lister, lister->WatchPath());
+    if (it == m_items.end())
+        return false;
+    m_items.splice(m_items.begin(), m_items, it);
+
+    state.lineSel = it->state.lineSel;
+    state.firstLine = it->state.firstLine;
+    state.selected = it->state.selected;
+    state.files.clear();
+    state.key = ListingCache::Key();
+    //Only if listed as it would be now, the directory is checked by the caller
+    const ListingCache::Key &key = it->state.key;
+    if (!it->state.files.empty() && key.lister == lister && key.sort == lister->GetSortMode() && key.metadata == lister->WantsMetadata())
+    {
+        //It will be saved again when the user leaves
+        size_t bytes = it->state.files.Bytes();
+        state.key = key;
+        state.files.swap(it->state.files);
+        it->bytes -= bytes;
+        m_bytes -= bytes;
+    }
+    return true;
+}
+
+//Snapshot keeps, for every lister, the last listing shown, with its path and selection,
+//in a file, so that at startup it can be drawn before the disk is even touched.
+//Only the names and the metadata are saved: the entries are built again with the current
+//configuration. The file is read with mmap() and replaced atomically when written.
+class Snapshot
+{
+public:
+    struct Entry
+    {
+        std::string name;
+        bool isDir;
+        uint32_t mtime;
+        uint64_t size;
+    };
+    struct Record
+    {
+        std::string path, selected;
+        int lineSel, firstLine;
+        ListingCache::Key key; //of the directory, without the lister
+        std::vector<Entry> entries;
+        Record()
+            :lineSel(0), firstLine(0)
+        {}
+    };
+    Snapshot()
+        :m_current(-1)
+    {}
+    bool Load(const std::string &fileName);
+    bool Save(const std::string &fileName) const;
+    void Set(int listerId, const Record &record)
+    { m_records[listerId] = record; }
+    const Record *Find(int listerId) const;
+    //The lister shown last, -1 if none
+    int Current() const
+    { return m_current; }
+    void SetCurrent(int listerId)
+    { m_current = listerId; }
+private:
+    typedef std::map<int, Record> records_t;
+    records_t m_records;
+    int m_current;
+
+    class Reader;
+    static void Put(std::string &out, const void *data, size_t size);
+    static void PutString(std::string &out, const std::string &str);
+};
+
+//Reads the fields of the file, checking that they are inside of it
+class Snapshot::Reader
+{
+public:
+    Reader(const char *data, size_t size)
+        :m_ptr(data), m_end(data + size)
+    {}
+    template <typename T> bool Get(T &value)
+    {
+        if (static_cast<size_t>(m_end - m_ptr) < sizeof(T))
+            return false;
+        memcpy(&value, m_ptr, sizeof(T));
+        m_ptr += sizeof(T);
+        return true;
+    }
+    bool GetString(std::string &str)
+    {
+        uint32_t len;
+        if (!Get(len) || static_cast<size_t>(m_end - m_ptr) < len)
+            return false;
+        str.assign(m_ptr, len);
+        m_ptr += len;
+        return true;
+    }
+    size_t Left() const
+    { return m_end - m_ptr; }
+private:
+    const char *m_ptr, *m_end;
+};
+
+static const char g_snapshotMagic[8] = {'R', 'C', 'S', 'N', 'A', 'P', '0', '1'};
+//The smallest encoded record and entry, with empty strings, to check the counts before allocating
+static const size_t g_snapshotMinRecord = 4 + 4 + 4 + 4 + 4 + 4 + 1 + 8 + 8 + 8 + 8 + 4;
+static const size_t g_snapshotMinEntry = 4 + 1 + 4 + 8;
+
+bool Snapshot::Load(const std::string &fileName)
+{
+    OpenFd fd(open(fileName.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(g_snapshotMagic)))
+        return false;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    Reader reader(static_cast<const char*>(map), st.st_size);
+    char magic[sizeof(g_snapshotMagic)];
+    int32_t current;
+    uint32_t count;
+    bool ok = reader.Get(magic) && memcmp(magic, g_snapshotMagic, sizeof(magic)) == 0 &&
+        reader.Get(current) && reader.Get(count) && count <= reader.Left() / g_snapshotMinRecord;
+    records_t records;
+    for (uint32_t r = 0; ok && r < count; ++r)
+    {
+        int32_t id, lineSel, firstLine, sort;
+        uint8_t metadata;
+        uint64_t dev, ino;
+        int64_t mtime, mtimeNsec;
+        uint32_t nEntries;
+        Record rec;
+        ok = reader.Get(id) && reader.GetString(rec.path) && reader.GetString(rec.selected) &&
+            reader.Get(lineSel) && reader.Get(firstLine) && reader.Get(sort) && reader.Get(metadata) &&
+            reader.Get(dev) && reader.Get(ino) && reader.Get(mtime) && reader.Get(mtimeNsec) &&
+            reader.Get(nEntries) && nEntries <= reader.Left() / g_snapshotMinEntry &&
+            sort >= 0 && sort < SORT_MODES;
+        if (!ok)
+            break;
+        rec.lineSel = lineSel;
+        rec.firstLine = firstLine;
+        rec.key.sort = static_cast<SortMode>(sort);
+        rec.key.metadata = metadata != 0;
+        rec.key.dev = dev;
+        rec.key.ino = ino;
+        rec.key.mtime = mtime;
+        rec.key.mtimeNsec = mtimeNsec;
+        rec.entries.resize(nEntries);
+        for (uint32_t i = 0; ok && i < nEntries; ++i)
+        {
+            Entry &entry = rec.entries[i];
+            uint8_t isDir;
+            ok = reader.GetString(entry.name) && reader.Get(isDir) && reader.Get(entry.mtime) && reader.Get(entry.size);
+            entry.isDir = isDir != 0;
+        }
+        records[id] = rec;
+    }
+    munmap(map, st.st_size);
+    if (!ok)
+    {   //it would fail again on every start
+        unlink(fileName.c_str());
+        return false;
+    }
+    m_records.swap(records);
+    m_current = current;
+    return true;
+}
+
+bool Snapshot::Save(const std::string &fileName) const
+{
+    std::string out(g_snapshotMagic, sizeof(g_snapshotMagic));
+    int32_t current = m_current;
+    uint32_t count = m_records.size();
+    Put(out, &current, sizeof(current));
+    Put(out, &count, sizeof(count));
+    for (records_t::const_iterator it = m_records.begin(); it != m_records.end(); ++it)
+    {
+        const Record &rec = it->second;
+        int32_t id = it->first, lineSel = rec.lineSel, firstLine = rec.firstLine, sort = rec.key.sort;
+        uint8_t metadata = rec.key.metadata;
+        uint64_t dev = rec.key.dev, ino = rec.key.ino;
+        int64_t mtime = rec.key.mtime, mtimeNsec = rec.key.mtimeNsec;
+        uint32_t nEntries = rec.entries.size();
+        Put(out, &id, sizeof(id));
+        PutString(out, rec.path);
+        PutString(out, rec.selected);
+        Put(out, &lineSel, sizeof(lineSel));
+        Put(out, &firstLine, sizeof(firstLine));
+        Put(out, &sort, sizeof(sort));
+        Put(out, &metadata, sizeof(metadata));
+        Put(out, &dev, sizeof(dev));
+        Put(out, &ino, sizeof(ino));
+        Put(out, &mtime, sizeof(mtime));
+        Put(out, &mtimeNsec, sizeof(mtimeNsec));
+        Put(out, &nEntries, sizeof(nEntries));
+        for (size_t i = 0; i < rec.entries.size(); ++i)
+        {
+            const Entry &entry = rec.entries[i];
+            uint8_t isDir = entry.isDir;
+            PutString(out, entry.name);
+            Put(out, &isDir, sizeof(isDir));
+            Put(out, &entry.mtime, sizeof(entry.mtime));
+            Put(out, &entry.size, sizeof(entry.size));
+        }
+    }
+
+    //Written aside and renamed, so that a crash never leaves half a file
+    std::string tmpName = fileName + ".tmp";
+    OpenFd fd(open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd == -1)
+        return false;
+    for (size_t done = 0; done < out.size(); )
+    {
+        ssize_t n = write(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            unlink(tmpName.c_str());
+            return false;
+        }
+        done += n;
+    }
+    //Else, after a crash, the rename may reach the disk before the data
+    if (fsync(fd) != 0)
+    {
+        unlink(tmpName.c_str());
+        return false;
+    }
+    fd.Reset();
+    return rename(tmpName.c_str(), fileName.c_str()) == 0;
+}
+
+const Snapshot::Record *Snapshot::Find(int listerId) const
+{
+    records_t::const_iterator it = m_records.find(listerId);
+    return it == m_records.end()? NULL : &it->second;
+}
+
+/*static*/void Snapshot::Put(std::string &out, const void *data, size_t size)
+{
+    out.append(static_cast<const char*>(data), size);
+}
+
+/*static*/void Snapshot::PutString(std::string &out, const std::string &str)
+{
+    uint32_t len = str.size();
+    Put(out, &len, sizeof(len));
+    out += str;
+}
+
+class MainWnd : private ILircClient, private IListJobClient, private IDirWatch, private IMediaClient
+{
+public:
+    MainWnd(const std::string &lircFile);
+    ~MainWnd();
+
+private:
+    enum { PREFETCH_DELAY_MS = 300, SNAPSHOT_DELAY_S = 10, PRUNE_DELAY_MS = 500 };
+    //The pruning job reports to this one, as it runs beside the listing job
+    struct PruneClient : public IListJobClient
+    {
+        MainWnd *wnd;
+        PruneClient(MainWnd *w)
+            :wnd(w)
+        {}
+        virtual void OnListBatch(EntryList &batch)
+        { wnd->OnPruneBatch(batch); }
+        virtual void OnListRemoved(EntryList &removed)
+        { wnd->OnPruneRemoved(removed); }
+        virtual void OnListDone()
+        { wnd->OnPruneDone(); }
+    };
+    //And so does the job that builds the entries of the files created
+    struct EntriesClient : public IListJobClient
+    {
+        MainWnd *wnd;
+        EntriesClient(MainWnd *w)
+            :wnd(w)
+        {}
+        virtual void OnListBatch(EntryList &batch)
+        { wnd->OnEntriesBatch(batch); }
+        virtual void OnListDone()
+        { wnd->OnEntriesDone(); }
+    };
+    GtkWindowPtr m_wnd;
+    GtkDrawingAreaPtr m_draw;
+    LircClient m_lirc;
+    Lister *m_lister;
+    int m_lineSel, m_firstLine, m_nLines;
+    EntryList m_files;
+    std::vector<int> m_playQueue;
+    ListJob *m_listJob;
+    Prefetcher *m_prefetcher; //NULL until the first prefetch
+    ListJob *m_warmUpJob;
+    bool m_warmedUp; //StartWarmUp() is called only once
+    ListJob *m_pruneJob;
+    PruneClient m_pruneClient;
+    std::string m_selectName; //entry to be selected when it is listed
+    ListingCache::Key m_dirKey; //of the current directory, when it was listed
+    NavHistory m_history;
+    Snapshot m_snapshot;
+    std::string m_snapshotFile;
+    bool m_revalidating; //m_files comes from the snapshot, the history or a change in the tree, and m_listJob is listing it again
+    bool m_truncated; //m_listJob has more files than fit in m_files
+    EntryList m_fresh; //the entries of that listing
+    //The entries received and not merged into m_files yet, and the buffer for the merge
+    EntryList m_unmerged, m_merged;
+    int m_watchWd; //taken from the listing job when it finishes
+    std::map<int, std::string> m_subWatches; //the same, for the subdirectories of a recursive listing
+    struct DirEvent
+    {
+        int wd;
+        uint32_t mask;
+        std::string name;
+    };
+    std::vector<DirEvent> m_pendingEvents; //received while listing, or building entries
+    ListJob *m_entriesJob;
+    EntriesClient m_entriesClient;
+    std::vector<std::string> m_created; //by the events applied, to be built by m_entriesJob
+    //The position of the file list in the window, saved by OnDrawCairo()
+    double m_listX, m_listY, m_listW, m_scrollW, m_lineH;
+    GPid m_childPid;
+    std::string m_childText;
+    bool m_isKillable;
+
+    AutoTimeout m_timeoutSpawned;
+    gboolean OnTimeoutSpawned();
+
+    AutoTimeout m_timeoutClock;
+    gboolean OnTimeoutClock();
+
+    //Fires if the listing makes no progress in g_options.listTimeout seconds
+    AutoTimeout m_timeoutList;
+    gboolean OnTimeoutList();
+
+    //Fires when the cursor has rested on a directory, to prefetch it
+    AutoTimeout m_timeoutPrefetch;
+    gboolean OnTimeoutPrefetch();
+
+    //The snapshot is saved a while after it changes, and at exit
+    AutoTimeout m_timeoutSnapshot;
+    gboolean OnTimeoutSnapshot();
+
+    //Fires after the subdirectories may have gained or lost their media, to prune them again
+    AutoTimeout m_timeoutPrune;
+    gboolean OnTimeoutPrune();
+
+    PangoFontDescriptionPtr m_font, m_fontTitle, m_fontQueue;
+
+    void OnDestroy(GtkWidget *w)
+    {
+        gtk_main_quit();
+    }
+#if GTK_MAJOR_VERSION < 3
+    gboolean OnDrawExpose(GtkWidget *w, GdkEventExpose *e);
+#else
+    gboolean OnDrawDraw(GtkWidget *w, cairo_t *cr);
+#endif
+    void OnDrawCairo(cairo_t *cr, int width, int height);
+    gboolean OnDrawKey(GtkWidget *w, GdkEventKey *e);
+    int PositionInQueue(int line);
+    void Move(int inc);
+    void Select(bool onlyDir);
+    void Queue();
+    void Unqueue();
+    void Back();
+    void Refresh(bool retry = false);
+    void ShowNotResponding();
+    void LeaveDir();
+    void EnterDir(const std::string &selectName);
+    void ChangeSort(SortMode sort);
+    void StopListing();
+    void ArmListTimeout();
+    void SchedulePrefetch();
+    void StopPrefetch();
+    void StartWarmUp();
+    void StartPrune();
+    void StopPrune();
+    void OnPruneBatch(EntryList &batch);
+    void OnPruneRemoved(EntryList &removed);
+    void OnEntriesBatch(EntryList &batch);
+    void OnEntriesDone();
+    void StartEntriesJob();
+    void StopEntriesJob();
+    void OnPruneDone();
+    bool RestoreSnapshot();
+    void StartRevalidation(ListJob::Seed *seed);
+    void FinishRevalidation();
+    void RecordSnapshot();
+    void SaveSnapshot();
+    void MergeEntries(EntryList &batch);
+    void TruncateListing();
+    void UnwatchDir();
+    void ApplyPendingEvents();
+    void ApplyDirEvent(int wd, uint32_t mask, const std::string &name);
+    void InsertEntry(const DirEntry &entry);
+    void ResolveName(size_t line);
+    DirEntry GetEntry(size_t line);
+    void RemoveEntry(const std::string &fileName);
+    void RemoveAt(int pos);
+    bool ChangeFavorite(int nfav);
+    void SetLister(Lister *lister);
+    void Open(const DirEntry &entry);
+    void AfterRun();
+    void OnChildWatch(GPid pid, gint status);
+
+    void Redraw();
+    void RedrawFrom(int line);
+
+    //ILircClient
+    virtual void OnLircCommand(const char *cmd);
+    //IListJobClient
+    virtual void OnListBatch(EntryList &batch);
+    virtual void OnListDone();
+    //IDirWatch
+    virtual void OnDirEvent(int wd, uint32_t mask, const char *name);
+    //IMediaClient
+    virtual void OnMediaChanged(const Lister *lister);
+};
+
+
+MainWnd::MainWnd(const std::string &lircFile)
+    :m_lirc(lircFile, this), m_lister(NULL), m_listJob(NULL), m_prefetcher(NULL), m_warmUpJob(NULL), m_warmedUp(false), m_pruneJob(NULL), m_pruneClient(this), m_history(16 * 1024 * 1024), m_revalidating(false), m_truncated(false), m_watchWd(-1), m_entriesJob(NULL), m_entriesClient(this), m_listX(0), m_listY(0), m_listW(0), m_scrollW(0), m_lineH(0),
+    m_childPid(0), m_isKillable(false)
+{
+    m_lister = &g_defaultLister;
+
+    m_wnd.Reset( gtk_window_new(GTK_WINDOW_TOPLEVEL) );
+    MIGTK_WIDGET_destroy(m_wnd, MainWnd, OnDestroy, this);
+
+    m_draw.Reset( gtk_drawing_area_new() );
+#if GTK_MAJOR_VERSION < 3
+    MIGTK_WIDGET_expose_event(m_draw, MainWnd, OnDrawExpose, this);
+    GdkColor black = {0, 0xFFFF * g_options.gr.colorBg.r, 0xFFFF * g_options.gr.colorBg.g, 0xFFFF * g_options.gr.colorBg.b};
+    gtk_widget_modify_bg(m_draw, GTK_STATE_NORMAL, &black);
+#else
+    MIGTK_WIDGET_draw(m_draw, MainWnd, OnDrawDraw, this);
+    GdkRGBA black = {g_options.gr.colorBg.r, g_options.gr.colorBg.g, g_options.gr.colorBg.b, 1.0};
+    gtk_widget_override_background_color(m_draw, GTK_STATE_FLAG_NORMAL, &black);
+#endif
+    gtk_widget_set_can_focus(m_draw, TRUE);
+    MIGTK_WIDGET_key_press_event(m_draw, MainWnd, OnDrawKey, this);
+    gtk_container_add(m_wnd, m_draw);
+
+    if (g_fullscreen)
+        gtk_window_fullscreen(m_wnd);
+
+    gtk_widget_show_all(m_draw);
+    if (!g_geometry.empty())
+        gtk_window_parse_geometry(m_wnd, g_geometry.c_str());
+    gtk_widget_show(m_wnd);
+
+    XResetScreenSaver(gdk_x11_get_default_xdisplay());
+
+    m_timeoutClock.SetTimeout(30000, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutClock), this);
+
+    //if (!ChangeFavorite(1))
+    //    ChangePath("/");
+    g_mediaIndex.SetClient(this);
+    m_snapshotFile = std::string(g_get_user_cache_dir()) + "/rclauncher/snapshot";
+    if (!RestoreSnapshot())
+        ChangeFavorite(1);
+}
+
+MainWnd::~MainWnd()
+{
+    RecordSnapshot();
+    m_timeoutSnapshot.Reset();
+    SaveSnapshot();
+    StopListing();
+    Prefetcher::Finish(m_prefetcher);
+    ListJob::Stop(m_warmUpJob);
+    g_mediaIndex.SetClient(NULL);
+}
+
+gboolean MainWnd::OnDrawKey(GtkWidget *w, GdkEventKey *e)
+{
+    if (m_childPid != 0)
+    {
+        if (m_isKillable && m_childPid && e->keyval == GDK_KEY_Escape)
+            kill(m_childPid, SIGTERM);
+        return TRUE;
+    }
+
+    switch (e->keyval)
+    {
+    case GDK_KEY_Up:
+    case GDK_KEY_KP_Up:
+        Move(-1);
+        break;
+    case GDK_KEY_Down:
+    case GDK_KEY_KP_Down:
+        Move(1);
+        break;
+    case GDK_KEY_Page_Up:
+    case GDK_KEY_KP_Page_Up:
+        Move(-m_nLines);
+        break;
+    case GDK_KEY_Page_Down:
+    case GDK_KEY_KP_Page_Down:
+        Move(m_nLines);
+        break;
+    case GDK_KEY_Left:
+    case GDK_KEY_KP_Left:
+        Back();
+        break;
+    case GDK_KEY_Right:
+    case GDK_KEY_KP_Right:
+        Select(true);
+        break;
+    case GDK_KEY_Return:
+    case GDK_KEY_KP_Enter:
+        Select(false);
+        break;
+    case GDK_KEY_KP_Add:
+    case GDK_KEY_plus:
+        Queue();
+        break;
+    case GDK_KEY_KP_Subtract:
+    case GDK_KEY_minus:
+        Unqueue();
+        break;
+    case GDK_KEY_space:
+        Refresh(true);
+        break;
+    case GDK_KEY_s:
+        ChangeSort(static_cast<SortMode>((m_lister->GetSortMode() + 1) % SORT_MODES));
+        break;
+    case GDK_KEY_1: 
+    case GDK_KEY_KP_1: 
+        ChangeFavorite(1); 
+        break;
+    case GDK_KEY_2: 
+    case GDK_KEY_KP_2: 
+        ChangeFavorite(2); 
+        break;
+    case GDK_KEY_3: 
+    case GDK_KEY_KP_3: 
+        ChangeFavorite(3); 
+        break;
+    case GDK_KEY_4: 
+    case GDK_KEY_KP_4: 
+        ChangeFavorite(4); 
+        break;
+    case GDK_KEY_5: 
+    case GDK_KEY_KP_5: 
+        ChangeFavorite(5); 
+        break;
+    case GDK_KEY_6: 
+    case GDK_KEY_KP_6: 
+        ChangeFavorite(6); 
+        break;
+    case GDK_KEY_7: 
+    case GDK_KEY_KP_7: 
+        ChangeFavorite(7); 
+        break;
+    case GDK_KEY_8: 
+    case GDK_KEY_KP_8: 
+        ChangeFavorite(8); 
+        break;
+    case GDK_KEY_9: 
+    case GDK_KEY_KP_9: 
+        ChangeFavorite(9); 
+        break;
+    case GDK_KEY_0: 
+    case GDK_KEY_KP_0: 
+        ChangeFavorite(10); 
+        break;
+    default:
+        if (g_verbose)
+            std::cout << "Unknown Key: 0x" << std::hex << e->keyval << std::dec << std::endl;
+        break;
+    }
+    return TRUE;
+}
+
+int MainWnd::PositionInQueue(int line)
+{
+    std::vector<int>::iterator itQueue = std::find(m_playQueue.begin(), m_playQueue.end(), line);
+    if (itQueue == m_playQueue.end())
+        return -1;
+    return itQueue - m_playQueue.begin();
+}
+
+void MainWnd::Move(int inc)
+{
+    m_selectName.clear(); //the user knows better
+    m_lineSel += inc;
+    if (m_lineSel >= static_cast<int>(m_files.size()))
+        m_lineSel = m_files.size() - 1;
+    else if (m_lineSel < 0)
+        m_lineSel = 0;
+    SchedulePrefetch();
+    Redraw();
+}
+
+void MainWnd::Select(bool onlyDir)
+{
+    if (!onlyDir && !m_playQueue.empty())
+    {
+        AfterRun();
+        return;
+    }
+
+    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
+        return;
+    DirEntry entry = GetEntry(m_lineSel);
+    if (entry.isDir)
+    {
+        if (entry.dispName == "..")
+        {
+            Back();
+        }
+        else
+        {
+            LeaveDir();
+            m_lister->ChangePath(entry);
+            EnterDir("");
+        }
+    }
+    else if (!onlyDir)
+    {
+        Open(entry);
+    }
+}
+
+void MainWnd::Queue()
+{
+    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
+        return;
+    EntryView entry = m_files[m_lineSel];
+    if (entry.IsDir())
+        return;
+    if (PositionInQueue(m_lineSel) != -1)
+        return;
+
+    m_playQueue.push_back(m_lineSel);
+    Redraw();
+}
+
+void MainWnd::Unqueue()
+{
+    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
+        return;
+    EntryView entry = m_files[m_lineSel];
+    if (entry.IsDir())
+        return;
+    int pos = PositionInQueue(m_lineSel);
+    if (pos == -1)
+        return;
+
+    m_playQueue.erase(m_playQueue.begin() + pos);
+    Redraw();
+}
+
+//If retry, a mount that was not responding is tried again at once
+void MainWnd::Refresh(bool retry)
+{
+    StopListing();
+    m_files.clear();
+    m_playQueue.clear();
+    m_selectName.clear();
+    m_lineSel = m_firstLine = 0;
+    m_nLines = 1;
+    m_dirKey = ListingCache::Key();
+    UnwatchDir();
+
+    std::string path = m_lister->WatchPath();
+    if (retry && !path.empty())
+        g_mountHealth.Retry(path);
+    if (!path.empty() && g_mountHealth.IsStalled(path))
+    {
+        m_files.push_back(DirEntry("..", "..", NULL, true));
+        ShowNotResponding();
+        return;
+    }
+
+    //The job watches the directory and takes its key, see OnListDone()
+    m_truncated = false;
+    m_listJob = new ListJob(m_lister, this, this);
+    ArmListTimeout();
+
+    Redraw();
+}
+
+//Adds a placeholder entry saying that the listing is incomplete
+void MainWnd::ShowNotResponding()
+{
+    InsertEntry(DirEntry("(not responding)", "", NULL, false, m_lister->GetSortMode()));
+    Redraw();
+}
+
+//Saves the current directory in the history, to be called before changing it
+void MainWnd::LeaveDir()
+{
+    if (!m_lister)
+        return;
+    RecordSnapshot();
+    bool complete = !m_listJob;
+    StopListing();
+    NavHistory::State state;
+    state.files.swap(m_files);
+    state.lineSel = m_lineSel;
+    state.firstLine = m_firstLine;
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(state.files.size()))
+        state.selected = state.files[m_lineSel].FileName();
+    state.key = m_dirKey;
+    m_history.Save(m_lister, state, complete);
+}
+
+//Shows the current directory of m_lister, from the history if possible, else it is listed.
+//selectName is the entry to select if the history does not know better.
+void MainWnd::EnterDir(const std::string &selectName)
+{
+    NavHistory::State state;
+    if (!m_history.Restore(m_lister, state))
+    {
+        Refresh();
+        m_selectName = selectName;
+        return;
+    }
+    std::string path = m_lister->WatchPath();
+    if (state.files.empty() || g_mountHealth.IsStalled(path))
+    {
+        Refresh();
+        m_selectName = state.selected;
+        return;
+    }
+    if (g_verbose)
+        std::cout << "From the history: " << path << std::endl;
+    //If the directory is unchanged, the listing will be just this
+    ListJob::Seed *seed = new ListJob::Seed;
+    seed->key = state.key;
+    seed->files = state.files;
+    if (!seed->files.empty() && strcmp(seed->files[0].FileName(), "..") == 0)
+        seed->files.erase(0);
+
+    m_files.swap(state.files);
+    m_playQueue.clear();
+    m_selectName.clear();
+    m_lineSel = std::min(state.lineSel, static_cast<int>(m_files.size()) - 1);
+    m_firstLine = std::min(state.firstLine, m_lineSel);
+    StartRevalidation(seed);
+}
+
+//Changes the sort mode of the current lister. If the entries already carry what the
+//new mode needs they are sorted again in memory, else the directory is listed again.
+void MainWnd::ChangeSort(SortMode sort)
+{
+    if (sort == m_lister->GetSortMode())
+        return;
+    //It would cache the entries with the old sort keys
+    StopPrefetch();
+    StopPrune();
+    std::string selected;
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(m_files.size()))
+        selected = m_files[m_lineSel].FileName();
+
+    if (m_listJob || (SortNeedsMetadata(sort) && !m_lister->WantsMetadata()))
+    {
+        StopListing();
+        m_lister->SetSortMode(sort);
+        Refresh();
+        m_selectName = selected;
+        return;
+    }
+
+    m_lister->SetSortMode(sort);
+    //What the history and the snapshot will expect
+    if (m_dirKey.lister)
+        m_dirKey.sort = sort;
+    int row = m_lineSel - m_firstLine;
+    EntryList rekeyed;
+    for (size_t i = 0; i < m_files.size(); ++i)
+    {
+        DirEntry entry = m_files.Get(i);
+        entry.MakeSortKey(sort);
+        rekeyed.push_back(entry);
+    }
+    std::vector<int> newPos;
+    rekeyed.Sort(&newPos);
+    m_files.swap(rekeyed);
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(newPos.size()))
+        m_lineSel = newPos[m_lineSel];
+    for (size_t q = 0; q < m_playQueue.size(); ++q)
+        m_playQueue[q] = newPos[m_playQueue[q]];
+    //Keep the selection at the same row of the screen
+    m_firstLine = std::max(m_lineSel - row, 0);
+    Redraw();
+}
+
+//The lister must not be modified while it is listing, so this must be called
+//before ChangePath() or Back(). Any running listing or prefetch is cancelled.
+void MainWnd::StopListing()
+{
+    StopPrefetch();
+    StopPrune();
+    StopEntriesJob();
+    m_timeoutList.Reset();
+    ListJob::Stop(m_listJob);
+    m_listJob = NULL;
+    m_revalidating = false;
+    m_fresh.clear();
+    //What has been received is kept, even if the listing is not complete
+    if (!m_unmerged.empty())
+    {
+        MergeEntries(m_unmerged);
+        m_unmerged.clear();
+    }
+}
+
+//The prefetch starts if the cursor is still on the same directory after a moment
+void MainWnd::SchedulePrefetch()
+{
+    StopPrefetch();
+    if (!m_listJob)
+        m_timeoutPrefetch.SetTimeout(PREFETCH_DELAY_MS, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutPrefetch), this);
+}
+
+void MainWnd::StopPrefetch()
+{
+    m_timeoutPrefetch.Reset();
+    if (m_prefetcher)
+        m_prefetcher->Cancel();
+}
+
+//Hides the subdirectories without media, if the lister does that, and shows again those
+//that have gained some. Most are known by the media index, and the rest are scanned.
+void MainWnd::StartPrune()
+{
+    StopPrune();
+    if (m_listJob)
+        return; //it will be done when the listing ends
+    PrefetchTarget *target = new PrefetchTarget;
+    if (!m_lister->BeginPrune(*target))
+    {
+        delete target;
+        return;
+    }
+    for (size_t i = 0; i < m_files.size(); ++i)
+    {
+        if (m_files[i].IsDir() && strcmp(m_files[i].FileName(), "..") != 0)
+            target->shown.insert(m_files[i].FileName());
+    }
+    if (g_verbose)
+        std::cout << "Prune " << target->path << std::endl;
+    m_pruneJob = new ListJob(std::vector<PrefetchTarget*>(1, target), &m_pruneClient);
+}
+
+void MainWnd::StopPrune()
+{
+    m_timeoutPrune.Reset();
+    ListJob::Stop(m_pruneJob);
+    m_pruneJob = NULL;
+}
+
+gboolean MainWnd::OnTimeoutPrune()
+{
+    StartPrune();
+    return FALSE;
+}
+
+//Only the changes come, but the entries may have changed since the prune started
+void MainWnd::OnPruneBatch(EntryList &batch)
+{
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        DirEntry entry = batch.Get(i);
+        if (m_files.Find(entry) == m_files.size())
+            InsertEntry(entry);
+    }
+}
+
+void MainWnd::OnPruneRemoved(EntryList &removed)
+{
+    for (size_t i = 0; i < removed.size(); ++i)
+    {
+        size_t pos = m_files.Find(removed.Get(i));
+        if (pos < m_files.size())
+            RemoveAt(pos);
+    }
+}
+
+void MainWnd::OnPruneDone()
+{
+    ListJob::Stop(m_pruneJob);
+    m_pruneJob = NULL;
+}
+
+void MainWnd::OnMediaChanged(const Lister *lister)
+{
+    if (lister == m_lister && !m_listJob)
+        m_timeoutPrune.SetTimeout(PRUNE_DELAY_MS, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutPrune), this);
+}
 
-    gtk_widget_show_all(m_draw);
-    if (!g_geometry.empty())
-        gtk_window_parse_geometry(m_wnd, g_geometry.c_str());
-    gtk_widget_show(m_wnd);
+//Lists the other favorites in the background, so that the first visit to each one is instant
+void MainWnd::StartWarmUp()
+{
+    if (g_options.warmUp <= 0)
+        return;
+    std::vector<PrefetchTarget*> targets;
+    for (size_t i = 0; i < g_options.favorites.size(); ++i)
+    {
+        Lister *lister = g_options.favorites[i];
+        if (lister == m_lister)
+            continue;
+        PrefetchTarget *target = new PrefetchTarget;
+        if (lister->BeginWarmUp(g_options.warmUp - 1, *target))
+            targets.push_back(target);
+        else
+            delete target;
+    }
+    if (!targets.empty())
+        m_warmUpJob = new ListJob(targets);
+}
 
-    XResetScreenSaver(gdk_x11_get_default_xdisplay());
+//Shows the listing saved in the snapshot, before the directory is even listed, and lists
+//it again in the background. Returns false if there is none.
+bool MainWnd::RestoreSnapshot()
+{
+    if (!m_snapshot.Load(m_snapshotFile))
+        return false;
+    int id = m_snapshot.Current();
+    Lister *lister = id == g_defaultLister.Id()? &g_defaultLister : NULL;
+    for (size_t i = 0; i < g_options.favorites.size() && !lister; ++i)
+    {
+        if (g_options.favorites[i]->Id() == id)
+            lister = g_options.favorites[i];
+    }
+    const Snapshot::Record *rec = lister? m_snapshot.Find(id) : NULL;
+    if (!rec || !lister->RestorePath(rec->path))
+        return false;
+    if (g_verbose)
+        std::cout << "From the snapshot: " << lister->WatchPath() << std::endl;
+
+    //The entries are sorted as configured now: a sort mode changed at runtime is not kept
+    //across restarts, and the configuration may have changed since it was saved
+    SetLister(lister);
+    EntryList files;
+    DirEntry entry;
+    for (size_t i = 0; i < rec->entries.size(); ++i)
+    {
+        const Snapshot::Entry &saved = rec->entries[i];
+        if (m_lister->RebuildEntry(saved.name, saved.isDir, saved.mtime, saved.size, entry))
+            files.push_back(entry);
+    }
+    files.Sort(NULL);
+    //If the directory is unchanged, the listing will be just this
+    ListJob::Seed *seed = NULL;
+    if (rec->key.sort == m_lister->GetSortMode() && rec->key.metadata == m_lister->WantsMetadata())
+    {
+        seed = new ListJob::Seed;
+        seed->key = rec->key;
+        seed->key.lister = m_lister;
+        seed->files = files;
+    }
+    std::string path = m_lister->WatchPath();
+    if (path != "/" && path != "//")
+        files.insert(0, DirEntry("..", "..", NULL, true));
 
-    m_timeoutClock.SetTimeout(30000, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutClock), this);
+    m_files.swap(files);
+    m_playQueue.clear();
+    m_selectName.clear();
+    m_lineSel = std::max(0, std::min(rec->lineSel, static_cast<int>(m_files.size()) - 1));
+    for (size_t i = 0; i < m_files.size(); ++i)
+    {
+        if (rec->selected == m_files[i].FileName())
+        {
+            m_lineSel = i;
+            break;
+        }
+    }
+    m_firstLine = std::max(0, std::min(rec->firstLine, m_lineSel));
+    StartRevalidation(seed);
+    return true;
+}
 
-    //if (!ChangeFavorite(1))
-    //    ChangePath("/");
-    ChangeFavorite(1);
+//Lists again the directory whose entries, known from before, are being shown.
+//Takes ownership of seed.
+void MainWnd::StartRevalidation(ListJob::Seed *seed)
+{
+    m_dirKey = ListingCache::Key();
+    UnwatchDir();
+    m_revalidating = true;
+    m_truncated = false;
+    m_listJob = new ListJob(m_lister, this, this, seed);
+    ArmListTimeout();
+    Redraw();
 }
 
-gboolean MainWnd::OnDrawKey(GtkWidget *w, GdkEventKey *e)
+//The new listing replaces what was shown, keeping the selection
+void MainWnd::FinishRevalidation()
 {
-    if (m_childPid != 0)
+    m_revalidating = false;
+    std::string selected;
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(m_files.size()))
+        selected = m_files[m_lineSel].FileName();
+    int row = m_lineSel - m_firstLine;
+
+    m_fresh.Sort(NULL);
+    m_files.swap(m_fresh);
+    m_fresh.clear();
+    m_playQueue.clear();
+    m_lineSel = 0;
+    for (size_t i = 0; i < m_files.size(); ++i)
     {
-        if (m_isKillable && m_childPid && e->keyval == GDK_KEY_Escape)
-            kill(m_childPid, SIGTERM);
-        return TRUE;
+        if (selected == m_files[i].FileName())
+        {
+            m_lineSel = i;
+            break;
+        }
     }
+    m_firstLine = std::max(m_lineSel - row, 0);
+    Redraw();
+}
 
-    switch (e->keyval)
+//Remembers the current directory in the snapshot, if its listing is complete
+void MainWnd::RecordSnapshot()
+{
+    Snapshot::Record rec;
+    if (!m_lister || m_listJob || m_dirKey.lister != m_lister || !m_lister->SavePath(rec.path))
+        return;
+    rec.key = m_dirKey;
+    rec.key.lister = NULL;
+    //The sort mode may have been changed since it was listed
+    rec.key.sort = m_lister->GetSortMode();
+    rec.key.metadata = m_lister->WantsMetadata();
+    rec.lineSel = m_lineSel;
+    rec.firstLine = m_firstLine;
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(m_files.size()))
+        rec.selected = m_files[m_lineSel].FileName();
+    rec.entries.reserve(m_files.size());
+    for (size_t i = 0; i < m_files.size(); ++i)
     {
-    case GDK_KEY_Up:
-    case GDK_KEY_KP_Up:
-        Move(-1);
-        break;
-    case GDK_KEY_Down:
-    case GDK_KEY_KP_Down:
-        Move(1);
-        break;
-    case GDK_KEY_Page_Up:
-    case GDK_KEY_KP_Page_Up:
-        Move(-m_nLines);
-        break;
-    case GDK_KEY_Page_Down:
-    case GDK_KEY_KP_Page_Down:
-        Move(m_nLines);
-        break;
-    case GDK_KEY_Left:
-    case GDK_KEY_KP_Left:
-        Back();
-        break;
-    case GDK_KEY_Right:
-    case GDK_KEY_KP_Right:
-        Select(true);
-        break;
-    case GDK_KEY_Return:
-    case GDK_KEY_KP_Enter:
-        Select(false);
-        break;
-    case GDK_KEY_KP_Add:
-    case GDK_KEY_plus:
-        Queue();
-        break;
-    case GDK_KEY_KP_Subtract:
-    case GDK_KEY_minus:
-        Unqueue();
-        break;
-    case GDK_KEY_space:
-        Refresh();
-        break;
-    case GDK_KEY_1: 
-    case GDK_KEY_KP_1: 
-        ChangeFavorite(1); 
-        break;
-    case GDK_KEY_2: 
-    case GDK_KEY_KP_2: 
-        ChangeFavorite(2); 
-        break;
-    case GDK_KEY_3: 
-    case GDK_KEY_KP_3: 
-        ChangeFavorite(3); 
-        break;
-    case GDK_KEY_4: 
-    case GDK_KEY_KP_4: 
-        ChangeFavorite(4); 
-        break;
-    case GDK_KEY_5: 
-    case GDK_KEY_KP_5: 
-        ChangeFavorite(5); 
-        break;
-    case GDK_KEY_6: 
-    case GDK_KEY_KP_6: 
-        ChangeFavorite(6); 
-        break;
-    case GDK_KEY_7: 
-    case GDK_KEY_KP_7: 
-        ChangeFavorite(7); 
-        break;
-    case GDK_KEY_8: 
-    case GDK_KEY_KP_8: 
-        ChangeFavorite(8); 
-        break;
-    case GDK_KEY_9: 
-    case GDK_KEY_KP_9: 
-        ChangeFavorite(9); 
-        break;
-    case GDK_KEY_0: 
-    case GDK_KEY_KP_0: 
-        ChangeFavorite(10); 
-        break;
-    default:
-        if (g_verbose)
-            std::cout << "Unknown Key: 0x" << std::hex << e->keyval << std::dec << std::endl;
-        break;
+        EntryView view = m_files[i];
+        Snapshot::Entry saved;
+        saved.name = view.FileName();
+        if (saved.name.empty() || saved.name == "..")
+            continue;
+        saved.isDir = view.IsDir();
+        saved.mtime = view.MTime();
+        saved.size = view.Size();
+        rec.entries.push_back(saved);
     }
-    return TRUE;
+    m_snapshot.Set(m_lister->Id(), rec);
+    m_snapshot.SetCurrent(m_lister->Id());
+    m_timeoutSnapshot.SetTimeoutSeconds(SNAPSHOT_DELAY_S, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutSnapshot), this);
 }
 
-int MainWnd::PositionInQueue(int line)
+void MainWnd::SaveSnapshot()
 {
-    std::vector<int>::iterator itQueue = std::find(m_playQueue.begin(), m_playQueue.end(), line);
-    if (itQueue == m_playQueue.end())
-        return -1;
-    return itQueue - m_playQueue.begin();
+    std::string dir = DirName(m_snapshotFile);
+    if ((g_mkdir_with_parents(dir.c_str(), 0700) != 0 || !m_snapshot.Save(m_snapshotFile)) && g_verbose)
+        std::cout << "Cannot save the snapshot " << m_snapshotFile << std::endl;
 }
 
-void MainWnd::Move(int inc)
+gboolean MainWnd::OnTimeoutSnapshot()
 {
-    m_lineSel += inc;
-    if (m_lineSel >= static_cast<int>(m_files.size()))
-        m_lineSel = m_files.size() - 1;
-    else if (m_lineSel < 0)
-        m_lineSel = 0;
-    Redraw();
+    SaveSnapshot();
+    return FALSE;
 }
 
-void MainWnd::Select(bool onlyDir)
+gboolean MainWnd::OnTimeoutPrefetch()
 {
-    if (!onlyDir && !m_playQueue.empty())
+    if (m_listJob || m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()) || !m_files[m_lineSel].IsDir())
+        return FALSE;
+    PrefetchTarget *target = new PrefetchTarget;
+    if (!m_lister->BeginPrefetch(GetEntry(m_lineSel), *target))
     {
-        AfterRun();
-        return;
+        delete target;
+        return FALSE;
     }
+    if (g_verbose)
+        std::cout << "Prefetch " << target->path << std::endl;
+    if (!m_prefetcher)
+        m_prefetcher = new Prefetcher;
+    m_prefetcher->Prefetch(target);
+    return FALSE;
+}
 
-    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
+void MainWnd::ArmListTimeout()
+{
+    if (g_options.listTimeout > 0)
+        m_timeoutList.SetTimeoutSeconds(g_options.listTimeout, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutList), this);
+}
+
+//The listing is stuck, probably in a network filesystem: give up on it and keep what has been listed
+gboolean MainWnd::OnTimeoutList()
+{
+    if (g_verbose)
+        std::cout << "Listing not responding: " << m_lister->WatchPath() << std::endl;
+    m_selectName.clear();
+    ListJob::Abandon(m_listJob);
+    m_listJob = NULL;
+    StopListing();
+    //Neither the changes nor a later visit can trust this listing
+    UnwatchDir();
+    m_dirKey = ListingCache::Key();
+    ShowNotResponding();
+    return FALSE;
+}
+
+//Merges a batch of new entries into the sorted m_files, keeping the
+//selection and the play queue pointing to the same entries.
+void MainWnd::MergeEntries(EntryList &batch)
+{
+    if (!EntryList::FitTogether(m_files, batch))
+    {
+        TruncateListing();
         return;
-    const DirEntry &entry = m_files[m_lineSel];
-    if (entry.isDir)
+    }
+    batch.Sort(NULL);
+
+    EntryList &merged = m_merged;
+    merged.clear(); //but it keeps its capacity
+    std::vector<int> newPos(m_files.size());
+    size_t i = 0, j = 0;
+    while (i < m_files.size() || j < batch.size())
     {
-        if (entry.dispName == "..")
+        if (j == batch.size() || (i < m_files.size() && !EntryList::Less(batch, j, m_files, i)))
         {
-            Back();
+            newPos[i] = merged.size();
+            merged.push_back(m_files, i++);
         }
         else
+            merged.push_back(batch, j++);
+    }
+    m_files.swap(merged);
+    merged.clear();
+
+    if (m_lineSel >= 0 && m_lineSel < static_cast<int>(newPos.size()))
+        m_lineSel = newPos[m_lineSel];
+    if (m_firstLine >= 0 && m_firstLine < static_cast<int>(newPos.size()))
+        m_firstLine = newPos[m_firstLine];
+    for (size_t q = 0; q < m_playQueue.size(); ++q)
+        m_playQueue[q] = newPos[m_playQueue[q]];
+
+    if (!m_selectName.empty())
+    {
+        for (size_t n = 0; n < m_files.size(); ++n)
         {
-            m_lister->ChangePath(entry);
-            Refresh();
+            if (m_selectName == m_files[n].FileName())
+            {
+                m_lineSel = n;
+                m_selectName.clear();
+                break;
+            }
         }
     }
-    else if (!onlyDir)
+}
+
+//The files that do not fit in m_files are dropped, and the listing ends as it is
+void MainWnd::TruncateListing()
+{
+    if (m_truncated)
+        return;
+    m_truncated = true;
+    if (g_verbose)
+        std::cout << "Too many files in " << m_lister->WatchPath() << ", the listing is truncated" << std::endl;
+    if (m_listJob)
+        m_listJob->Cancel();
+}
+
+void MainWnd::OnListBatch(EntryList &batch)
+{
+    ArmListTimeout();
+    if (batch.Full())
+        TruncateListing();
+    //What was shown stays until the listing is complete
+    if (m_revalidating)
     {
-        Open(entry);
+        if (!m_fresh.append(batch))
+            TruncateListing();
+        return;
+    }
+    if (m_unmerged.empty())
+        m_unmerged.swap(batch);
+    else if (!m_unmerged.append(batch))
+        TruncateListing();
+    //A merge costs as much as the entries already there, so wait until the new ones are
+    //a good part of them: then the cost of the whole listing is linear
+    if (m_unmerged.size() >= m_files.size() / 2)
+    {
+        MergeEntries(m_unmerged);
+        m_unmerged.clear();
+        Redraw();
     }
 }
 
-void MainWnd::Queue()
+void MainWnd::OnListDone()
 {
-    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
+    m_watchWd = m_listJob->TakeWatch();
+    m_listJob->TakeSubWatches(m_subWatches);
+    //A partial listing must not be taken for the contents of the directory
+    m_dirKey = m_truncated? ListingCache::Key() : m_listJob->DirKey();
+    if (m_revalidating)
+        FinishRevalidation();
+    StopListing(); //that merges the last entries
+    m_selectName.clear();
+    Redraw();
+    RecordSnapshot();
+    SchedulePrefetch();
+    StartPrune();
+    //Not before, so that it does not compete with the first listing
+    if (!m_warmedUp)
+    {
+        m_warmedUp = true;
+        StartWarmUp();
+    }
+
+    ApplyPendingEvents();
+}
+
+void MainWnd::UnwatchDir()
+{
+    if (m_watchWd != -1)
+    {
+        g_dirWatcher.RemoveWatch(m_watchWd, this);
+        m_watchWd = -1;
+    }
+    for (std::map<int, std::string>::iterator it = m_subWatches.begin(); it != m_subWatches.end(); ++it)
+        g_dirWatcher.RemoveWatch(it->first, this);
+    m_subWatches.clear();
+    m_pendingEvents.clear();
+    m_created.clear();
+}
+
+void MainWnd::OnDirEvent(int wd, uint32_t mask, const char *name)
+{
+    DirEvent evt;
+    evt.wd = wd;
+    evt.mask = mask;
+    evt.name = name;
+    m_pendingEvents.push_back(evt);
+    //While listing, the changes may or may not be seen by the lister, so wait until it finishes.
+    //Its watch is not known until then. While building entries, wait too, to keep the order.
+    if (!m_listJob && !m_entriesJob)
+        ApplyPendingEvents();
+}
+
+void MainWnd::ApplyPendingEvents()
+{
+    std::vector<DirEvent> events;
+    events.swap(m_pendingEvents);
+    for (size_t i = 0; i < events.size(); ++i)
+        ApplyDirEvent(events[i].wd, events[i].mask, events[i].name);
+    StartEntriesJob();
+}
+
+//The files created are only noted here, as stat'ing them may block the main loop
+void MainWnd::ApplyDirEvent(int wd, uint32_t mask, const std::string &name)
+{
+    std::string fileName; //relative to the directory shown
+    if (wd != m_watchWd)
+    {
+        std::map<int, std::string>::iterator it = m_subWatches.find(wd);
+        if (it == m_subWatches.end())
+            return;
+        if (mask & IN_IGNORED)
+        {
+            m_subWatches.erase(it);
+            return;
+        }
+        fileName = it->second + "/";
+    }
+    else if (mask & IN_IGNORED)
+    {
+        m_watchWd = -1;
         return;
-    const DirEntry &entry = m_files[m_lineSel];
-    if (entry.isDir)
+    }
+    if (name.empty())
         return;
-    if (PositionInQueue(m_lineSel) != -1)
+    fileName += name;
+    if (g_verbose)
+        std::cout << "Dir event 0x" << std::hex << mask << std::dec << ": " << fileName << std::endl;
+    if ((mask & IN_ISDIR) && m_lister->IsRecursive())
+    {
+        //The hidden folders are not walked. Of the others, created, moved or deleted, the
+        //files shown are known only by walking the tree again.
+        if (name[0] != '.')
+            StartRevalidation(NULL);
+        return;
+    }
+    //A file can be created over an existing one, so remove it always
+    RemoveEntry(fileName);
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        m_created.push_back(fileName);
+}
+
+void MainWnd::StartEntriesJob()
+{
+    if (m_created.empty() || m_entriesJob)
         return;
+    m_entriesJob = new ListJob(m_lister, &m_entriesClient, m_created);
+    m_created.clear();
+}
+
+void MainWnd::StopEntriesJob()
+{
+    ListJob::Stop(m_entriesJob);
+    m_entriesJob = NULL;
+    m_created.clear();
+}
+
+//No event has been applied since the job started, so the entries are still new
+void MainWnd::OnEntriesBatch(EntryList &batch)
+{
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        DirEntry entry = batch.Get(i);
+        if (m_files.Find(entry) < m_files.size())
+            continue;
+        InsertEntry(entry);
+        //It may have to be hidden
+        if (entry.isDir)
+            m_timeoutPrune.SetTimeout(PRUNE_DELAY_MS, MIGLIB_TIMEOUT_FUNC(MainWnd, OnTimeoutPrune), this);
+    }
+}
+
+void MainWnd::OnEntriesDone()
+{
+    ListJob::Stop(m_entriesJob);
+    m_entriesJob = NULL;
+    ApplyPendingEvents();
+}
+
+void MainWnd::InsertEntry(const DirEntry &entry)
+{
+    int pos = m_files.UpperBound(entry);
+    m_files.insert(pos, entry);
+
+    if (m_lineSel >= pos && m_files.size() > 1)
+        ++m_lineSel;
+    for (size_t q = 0; q < m_playQueue.size(); ++q)
+    {
+        if (m_playQueue[q] >= pos)
+            ++m_playQueue[q];
+    }
+    RedrawFrom(pos);
+}
+
+//Computes the display name of a lazyName entry, only once
+void MainWnd::ResolveName(size_t line)
+{
+    EntryView entry = m_files[line];
+    if (!entry.IsNameReady())
+        m_files.SetDispName(line, m_lister->TransformName(entry.FileName()));
+}
 
-    m_playQueue.push_back(m_lineSel);
-    Redraw();
+DirEntry MainWnd::GetEntry(size_t line)
+{
+    ResolveName(line);
+    return m_files.Get(line);
 }
 
-void MainWnd::Unqueue()
+//The entry is rebuilt from the name, without touching the filesystem, to find it by its
+//sort key. If the sort uses the metadata, that of a file already gone is not known.
+void MainWnd::RemoveEntry(const std::string &fileName)
 {
-    if (m_lineSel < 0 || m_lineSel >= static_cast<int>(m_files.size()))
-        return;
-    const DirEntry &entry = m_files[m_lineSel];
-    if (entry.isDir)
-        return;
-    int pos = PositionInQueue(m_lineSel);
-    if (pos == -1)
+    if (!m_lister->WantsMetadata())
+    {
+        DirEntry entry;
+        for (int isDir = 0; isDir < 2; ++isDir)
+        {
+            //If it cannot be built, it is not shown
+            if (!m_lister->RebuildEntry(fileName, isDir != 0, 0, 0, entry))
+                continue;
+            size_t pos = m_files.Find(entry);
+            if (pos < m_files.size())
+            {
+                RemoveAt(pos);
+                break;
+            }
+        }
         return;
-
-    m_playQueue.erase(m_playQueue.begin() + pos);
-    Redraw();
+    }
+    for (size_t pos = 0; pos < m_files.size(); ++pos)
+    {
+        if (fileName == m_files[pos].FileName())
+        {
+            RemoveAt(pos);
+            break;
+        }
+    }
 }
 
-void MainWnd::Refresh()
+void MainWnd::RemoveAt(int pos)
 {
-    m_files.clear();
-    m_playQueue.clear();
-    m_lister->ListDir(m_files);
-    m_lineSel = m_firstLine = 0;
-    m_nLines = 1;
+    m_files.erase(pos);
 
-    Redraw();
+    if (m_lineSel > pos)
+        --m_lineSel;
+    if (m_lineSel >= static_cast<int>(m_files.size()))
+        m_lineSel = std::max(static_cast<int>(m_files.size()) - 1, 0);
+    for (size_t q = 0; q < m_playQueue.size(); )
+    {
+        if (m_playQueue[q] == pos)
+        {
+            m_playQueue.erase(m_playQueue.begin() + q);
+            continue;
+        }
+        if (m_playQueue[q] > pos)
+            --m_playQueue[q];
+        ++q;
+    }
+    RedrawFrom(pos);
 }
 
 void MainWnd::Back()
 {
+    LeaveDir();
+
     std::string base;
     if (!m_lister->Back(base))
     {
         std::string cwd = m_lister->Root();
         base = BaseName(cwd);
         cwd = DirName(cwd);
-        m_lister = &g_defaultLister;
+        SetLister(&g_defaultLister);
         m_lister->ChangePath(cwd);
     }
-    Refresh();
+    EnterDir(base);
+}
 
-    for (size_t i = 0; i < m_files.size(); ++i)
-    {
-        if (m_files[i].fileName == base)
-        {
-            m_lineSel = i;
-            break;
-        }
-    }
+//The previous lister must not keep its directories open
+void MainWnd::SetLister(Lister *lister)
+{
+    if (m_lister && m_lister != lister)
+        m_lister->ReleaseDirs();
+    m_lister = lister;
 }
 
 bool MainWnd::ChangeFavorite(int nfav)
@@ -1085,9 +6576,10 @@ bool MainWnd::ChangeFavorite(int nfav)
     if (i == g_options.favorites.size())
         return false;
 
-    m_lister = g_options.favorites[i];
+    LeaveDir();
+    SetLister(g_options.favorites[i]);
     m_lister->ChangePath("/");
-    Refresh();
+    EnterDir("");
 
     return true;
 }
@@ -1196,7 +6688,7 @@ void MainWnd::AfterRun()
     {
         int q = m_playQueue[0];
         m_playQueue.erase(m_playQueue.begin());
-        Open(m_files[q]);
+        Open(GetEntry(q));
     }
 }
 
@@ -1280,6 +6772,12 @@ void MainWnd::OnDrawCairo(cairo_t *cr, int width, int height)
     szH = m_nLines * lineH;
     marginY2 = height - (marginY1 + szH);
 
+    m_listX = marginX1;
+    m_listY = marginY1;
+    m_listW = szW;
+    m_scrollW = scrollW;
+    m_lineH = lineH;
+
     GraphicOptions::Color &fg = m_playQueue.empty()? g_options.gr.colorFg : g_options.gr.colorFgQ;
     fg.set_source(cr);
     cairo_translate(cr, marginX1, marginY1);
@@ -1318,7 +6816,8 @@ void MainWnd::OnDrawCairo(cairo_t *cr, int width, int height)
 
     for (size_t nLine = m_firstLine; nLine < m_files.size() && static_cast<int>(nLine) < m_firstLine + m_nLines; ++nLine)
     {
-        const DirEntry &entry = m_files[nLine];
+        ResolveName(nLine);
+        EntryView entry = m_files[nLine];
 
         if (static_cast<int>(nLine) == m_lineSel)
         {
@@ -1345,7 +6844,7 @@ void MainWnd::OnDrawCairo(cairo_t *cr, int width, int height)
             cairo_translate(cr, -DELTA_X/2, 0);
         }
 
-        if (entry.isDir)
+        if (entry.IsDir())
         {
             //A small ugly folder. It is designed with a lineH size of 37, 
             //so scale it accordingly
@@ -1376,7 +6875,7 @@ void MainWnd::OnDrawCairo(cairo_t *cr, int width, int height)
         }
         //Move forward to draw the text
         cairo_translate(cr, extraMargin, 0);
-        pango_layout_set_text(layout, entry.dispName.data(), entry.dispName.size());
+        pango_layout_set_text(layout, entry.DispName(), -1);
         pango_layout_set_width(layout, (szW - extraMargin) * PANGO_SCALE);
 
         //The name itself
@@ -1444,6 +6943,29 @@ void MainWnd::Redraw()
     gtk_widget_queue_draw(m_draw);
 }
 
+//Redraws the rows of the list from the given one to the bottom, and the scroll bar,
+//because all these rows have moved.
+void MainWnd::RedrawFrom(int line)
+{
+    //If the selection went off the screen OnDrawCairo() will scroll, so everything changes
+    if (m_lineH <= 0 || m_lineSel < m_firstLine || m_lineSel >= m_firstLine + m_nLines)
+    {
+        Redraw();
+        return;
+    }
+    //Some margin for the borders
+    const int M = 2;
+    int top = int(m_listY) - M;
+    int bottom = int(m_listY + m_nLines * m_lineH) + M;
+    int row = std::max(line - m_firstLine, 0);
+    if (row < m_nLines)
+    {
+        int y = int(m_listY + row * m_lineH) - M;
+        gtk_widget_queue_draw_area(m_draw, int(m_listX) - M, y, int(m_listW) + 2 * M, bottom - y);
+    }
+    gtk_widget_queue_draw_area(m_draw, int(m_listX + m_listW) - M, top, int(m_scrollW) + 2 * M, bottom - top);
+}
+
 void MainWnd::OnLircCommand(const char *cmd)
 {
     if (m_childPid != 0)
@@ -1476,7 +6998,17 @@ void MainWnd::OnLircCommand(const char *cmd)
     else if (strcmp(cmd, "left") == 0)
         Back();
     else if (strcmp(cmd, "refresh") == 0)
-        Refresh();
+        Refresh(true);
+    else if (strcmp(cmd, "sort") == 0)
+        ChangeSort(static_cast<SortMode>((m_lister->GetSortMode() + 1) % SORT_MODES));
+    else if (strlen(cmd) > 5 && memcmp(cmd, "sort ", 5) == 0)
+    {
+        SortMode sort;
+        if (ParseSortMode(cmd + 5, sort))
+            ChangeSort(sort);
+        else if (g_verbose)
+            std::cout << "Unknown sort mode: " << cmd + 5 << std::endl;
+    }
     else if (strcmp(cmd, "queue") == 0)
         Queue();
     else if (strcmp(cmd, "unqueue") == 0)
@@ -1525,9 +7057,10 @@ public:
                 SetStateNext(TAG_NAME, "transform", TAG_NAME_TRANSFORM, NULL);
             }
         }
+        SetStateAttr(TAG_FAVORITES, "list_timeout", "warm_up", NULL);
         SetStateAttr(TAG_FONT, "name", "desc", NULL);
         SetStateAttr(TAG_COLOR, "name", "r", "g", "b", NULL);
-        SetStateAttr(TAG_FAVORITE, "num", "title", "path", "module", NULL);
+        SetStateAttr(TAG_FAVORITE, "num", "title", "path", "module", "sort", "recursive", "hide_empty", NULL);
         SetStateAttr(TAG_PATTERN, "match", "ext", "command", "killable", NULL);
         SetStateAttr(TAG_NAME_TRANSFORM, "regex", "to", "flags", NULL);
     }
@@ -1536,6 +7069,12 @@ protected:
     {
         switch (state)
         {
+        case TAG_FAVORITES:
+            if (!atts[0].empty())
+                g_options.listTimeout = std::max(0, atoi(atts[0].c_str()));
+            if (!atts[1].empty())
+                g_options.warmUp = std::max(0, atoi(atts[1].c_str()));
+            break;
         case TAG_FONT:
             ParseFont(atts);
             break;
@@ -1567,6 +7106,11 @@ protected:
         }
     }
 private:
+    static bool IsTrue(const std::string &value)
+    {
+        return !value.empty() && 
+            (atoi(value.c_str()) != 0 || value[0] == 'y' || value[0] == 'Y');
+    }
     void ParseFont(const attributes_t &atts)
     {
         const std::string &name = atts[0], &desc = atts[1];
@@ -1595,18 +7139,31 @@ private:
     void ParseFavorite(const attributes_t &atts)
     {
         const std::string &num = atts[0], &name = atts[1], &path = atts[2], &module = atts[3];
+        const std::string &sort = atts[4], &recursive = atts[5], &hideEmpty = atts[6];
         int id = atoi(num.c_str());
         if (id != 0)
         {
             m_curLister = NULL;
             if (module.empty() || module == "file")
-                m_curLister = new FileLister(id, name, path);
+            {
+                FileLister *lister = new FileLister(id, name, path);
+                lister->SetRecursive(IsTrue(recursive));
+                lister->SetHideEmpty(IsTrue(hideEmpty));
+                m_curLister = lister;
+            }
             else if (module == "amule")
                 m_curLister = new AmuleLister(id, path);
             else if (module == "openedfiles")
                 m_curLister = new OpenedFileLister(id, GetExtraArg("title", "Opened"));
             if (m_curLister)
+            {
+                SortMode sortMode;
+                if (ParseSortMode(sort, sortMode))
+                    m_curLister->SetSortMode(sortMode);
+                else if (!sort.empty() && g_verbose)
+                    std::cout << "Unknown sort mode '" << sort << "'" << std::endl;
                 g_options.favorites.push_back(m_curLister);
+            }
             else
             {
                 if (g_verbose)
@@ -1625,8 +7182,9 @@ private:
         try
         {
             assoc = new FileAssoc(regex.c_str(), REG_EXTENDED | REG_ICASE | REG_NOSUB);
-            if (!killable.empty() && 
-                    (atoi(killable.c_str()) != 0 || killable[0] == 'y' || killable[0] == 'Y'))
+            if (!isRegex)
+                assoc->ext = ext;
+            if (IsTrue(killable))
                 assoc->isKillable = true;
 
             bool isFileArg = false;
@@ -1670,8 +7228,9 @@ private:
             if (flags.find('i') != std::string::npos)
                 cflags |= REG_ICASE;
             bool global = flags.find('g') != std::string::npos;
+            bool displayOnly = flags.find('d') != std::string::npos;
 
-            nt = new NameTrans(regex.c_str(), cflags, global, to.c_str());
+            nt = new NameTrans(regex.c_str(), cflags, global, displayOnly, to.c_str());
             if (m_curLister)
                 m_curLister->AddNameTransform(nt);
             else
@@ -1705,14 +7264,604 @@ static void Help(char *argv0)
     << "\t-v  Verbose: output some information to the terminal.\n"
     << "\t-f  Do not go fullscreen.\n"
     << "\t-d  Hide rclauncher while running the a parogram.\n"
+#ifdef RCLAUNCHER_BENCHMARK
+    << "\t--benchmark <dir>\n"
+    << "\t    Measure the directory listing backends on a directory with many\n"
+    << "\t    files, created inside <dir> if needed, and exit.\n"
+#endif
     << std::endl;
 }
 
+#if defined(RCLAUNCHER_BENCHMARK) || defined(RCLAUNCHER_TEST)
+//The associations of the benchmark and of the test: a bit of everything the AssocMatcher
+//understands, and some that it leaves to regexec()
+static void MakeTestAssocs(std::vector<FileAssoc*> &assocs)
+{
+    static const char *patterns[] =
+    {
+        "\\.(avi|mpg|mkv|wmv)$", "^FlashXX", "\\.mp3$", "\\.jpg$", "\\.(mp4|m4v|mov|webm|flv|ogv|3gp|vob)$",
+        "\\.m2?ts$", "\\.(flac|ogg|opus|wav|m4a|aac|wma)$", "\\.(png|gif|bmp|tiff?|webp)$", "\\.jpe?g$",
+        "\\.(pdf|epub|mobi|djvu)$", "\\.cb[rz7t]$", "\\.(iso|img|bin|cue)$", "\\.(srt|sub|ass|ssa|idx)$",
+        "\\.(nfo|txt|md)$", "^\\.", "~$", "\\.(part|tmp|crdownload)$", "(^|[^a-z])sample([^a-z]|$)",
+        "^[0-9]{2,3} - ", "[Ss][0-9]+[Ee][0-9]+", "^Episode S0[0-5]", "E0{2}[0-9]", "[^.]{20,}",
+        "^.{3}$", "a.b", "^(ab|a)*c$", "x{2,}y?", "^[^a-z]*$", "(a|b|)+\\.", "[]a-]x", "[^]a-]x",
+        "^(S|E)+[0-9]{1,2}\\.", "\\.(e|x)+(f)?$", "^.+ - 0{4,}", "\\\\", "\\.$", "^$", "é",
+        "[[:digit:]]{6}\\.txt$", "\\bfoo\\b", "(mkv|avi)\\.[a-z]+$", "[[:upper:]]{3}$", "\\.(zip|rar|7z)$",
+        "\\.ÑFO$", "^[a-f0-9]{8}\\.", ".", "",
+    };
+    //As RCParser::ParsePattern() makes them, the last two are not plain extensions
+    static const char *extensions[] =
+    {
+        "mp3", "JPG", "mp4", "m4v", "flac", "ogg", "png", "gif", "pdf", "epub", "srt", "nfo", "zip", "mkv",
+        "jpeg", "tar.gz", "mp[34]",
+    };
+    const size_t nExtensions = sizeof(extensions) / sizeof(*extensions);
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(*patterns); ++i)
+    {
+        assocs.push_back(new FileAssoc(patterns[i], REG_EXTENDED | REG_ICASE | REG_NOSUB));
+        if (i < nExtensions)
+        {
+            std::string regex = "\\." + std::string(extensions[i]) + "$";
+            assocs.push_back(new FileAssoc(regex.c_str(), REG_EXTENDED | REG_ICASE | REG_NOSUB));
+            assocs.back()->ext = extensions[i];
+        }
+    }
+}
+
+//count names like those of the benchmark directory, and as many made of pieces of the patterns
+static void MakeTestNames(int count, std::vector<std::string> &names)
+{
+    static const char *pieces[] =
+    {
+        "a", "b", "c", "x", "y", "A", "B", "X", "ab", "S01", "E002", "s1e2", "0000", "12", "2024", "deadbeef",
+        ".", ".", ".avi", ".MKV", ".Mp3", "jpg", ".jpeg", ".tif", ".m2ts", ".cbz", "flac", "sample", "Sample-",
+        "é", "ñ", "Ñ", "日本", " - ", "Episode S03", "FlashXX", "~", "_", "-", "]", "\\", "foo", "e", "f",
+        ".PNG", ".mp4", ".Srt", ".tar.gz", ".tarXgz", ".mp4.part", ".mp", "3",
+    };
+    const int nPieces = sizeof(pieces) / sizeof(*pieces);
+    for (int i = 0; i < count; ++i)
+    {
+        static const char *exts[] = { "avi", "mkv", "mp3", "jpg", "nfo", "txt" };
+        char name[64];
+        snprintf(name, sizeof(name), "Episode S%02dE%03d - %06d.%s", i / 1000, i % 1000, i, exts[i % 6]);
+        names.push_back(name);
+    }
+    srand(1);
+    for (int i = 0; i < count; ++i)
+    {
+        std::string name;
+        for (int n = 1 + rand() % 6; n > 0; --n)
+            name += pieces[rand() % nPieces];
+        names.push_back(name);
+    }
+}
+
+//Returns the number of names that the AssocMatcher and regexec() match differently,
+//and prints the first report of them
+static size_t CheckAssocs(const std::vector<FileAssoc*> &assocs, const AssocMatcher &matcher,
+        const std::vector<std::string> &names, size_t report)
+{
+    size_t wrong = 0;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        FileAssoc *expected = FileAssoc::Match(assocs, names[i].c_str());
+        FileAssoc *got = matcher.Match(names[i].c_str());
+        if (got == expected)
+            continue;
+        if (wrong++ < report)
+        {
+            std::cout << "  MISMATCH '" << names[i] << "': '" << (got? got->pattern : "") << "' instead of '"
+                << (expected? expected->pattern : "") << "'" << std::endl;
+        }
+    }
+    return wrong;
+}
+#endif
+
+#ifdef RCLAUNCHER_BENCHMARK
+
+//Creates a directory with many files, if it does not exist yet
+static bool PopulateBenchDir(const std::string &path, int count)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        return S_ISDIR(st.st_mode);
+    if (mkdir(path.c_str(), 0755) != 0)
+        return false;
+
+    std::cout << "Creating " << count << " files in " << path << "..." << std::endl;
+    static const char *exts[] = { "avi", "mkv", "mp3", "jpg", "nfo", "txt" };
+    const int nExts = sizeof(exts) / sizeof(*exts);
+    OpenFd fd(open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1)
+        return false;
+    for (int i = 0; i < count; ++i)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "Episode S%02dE%03d - %06d.%s", i / 1000, i % 1000, i, exts[i % nExts]);
+        int f = openat(fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (f == -1)
+            return false;
+        close(f);
+    }
+    return true;
+}
+
+//A library of dirs * dirs directories with files files each, nested in two levels
+static bool PopulateBenchTree(const std::string &path, int dirs, int files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        return S_ISDIR(st.st_mode);
+    if (mkdir(path.c_str(), 0755) != 0)
+        return false;
+
+    std::cout << "Creating " << dirs * dirs * files << " files in " << dirs * dirs << " directories in " << path << "..." << std::endl;
+    static const char *exts[] = { "avi", "mkv", "mp3", "jpg", "nfo", "txt" };
+    const int nExts = sizeof(exts) / sizeof(*exts);
+    for (int a = 0; a < dirs; ++a)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/Series %03d", a);
+        std::string top = path + name;
+        if (mkdir(top.c_str(), 0755) != 0)
+            return false;
+        for (int b = 0; b < dirs; ++b)
+        {
+            snprintf(name, sizeof(name), "/Season %03d", b);
+            std::string sub = top + name;
+            if (mkdir(sub.c_str(), 0755) != 0)
+                return false;
+            OpenFd fd(open(sub.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (fd == -1)
+                return false;
+            for (int i = 0; i < files; ++i)
+            {
+                snprintf(name, sizeof(name), "Episode S%02dE%03d.%s", b, i, exts[i % nExts]);
+                int f = openat(fd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+                if (f == -1)
+                    return false;
+                close(f);
+            }
+        }
+    }
+    return true;
+}
+
+//Writes the dirty pages and drops the page, dentry and inode caches. Needs root.
+static bool DropCaches()
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd, "3", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+//Returns the best time of several runs, in milliseconds
+static double TimeListing(FileLister &lister, int runs, bool cold, size_t &count)
+{
+    gint64 best = 0;
+    for (int i = 0; i < runs; ++i)
+    {
+        if (cold)
+            DropCaches();
+        ListSink sink;
+        gint64 t0 = g_get_monotonic_time();
+        lister.ListDir(sink);
+        sink.Flush();
+        gint64 t = g_get_monotonic_time() - t0;
+        if (i == 0 || t < best)
+            best = t;
+        //The files shown, without the .. entry
+        count = 0;
+        for (size_t n = 0; n < sink.files.size(); ++n)
+        {
+            if (strcmp(sink.files[n].FileName(), "..") != 0)
+                ++count;
+        }
+    }
+    return best / 1000.0;
+}
+
+//How DirEntry::operator< used to compare, without the sort keys
+struct StrcollLess
+{
+    bool operator()(const DirEntry &a, const DirEntry &b) const
+    {
+        if (a.isDir != b.isDir)
+            return a.isDir;
+        bool p1 = a.dispName == "..", p2 = b.dispName == "..";
+        if (p1 != p2)
+            return p1;
+        return strcoll(a.dispName.c_str(), b.dispName.c_str()) < 0;
+    }
+};
+
+static void BenchmarkSort(int count)
+{
+    std::vector<DirEntry> entries;
+    entries.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        //7919 is prime, so this shuffles the names
+        int n = static_cast<int>((i * 7919LL) % count);
+        char name[64];
+        snprintf(name, sizeof(name), "Episode S%02dE%03d - %06d.avi", n / 1000, n % 1000, n);
+        entries.push_back(DirEntry(name, name, NULL, n % 50 == 0));
+    }
+
+    std::vector<DirEntry> v(entries);
+    gint64 t0 = g_get_monotonic_time();
+    std::sort(v.begin(), v.end(), StrcollLess());
+    gint64 tColl = g_get_monotonic_time() - t0;
+
+    gint64 tKeys[2], tSort[2];
+    size_t keyBytes[2] = { 0, 0 }, nameBytes = 0;
+    for (int m = 0; m < 2; ++m)
+    {
+        v = entries;
+        t0 = g_get_monotonic_time();
+        for (size_t i = 0; i < v.size(); ++i)
+            v[i].MakeSortKey(m == 0? SORT_NAME : SORT_NATURAL);
+        tKeys[m] = g_get_monotonic_time() - t0;
+        t0 = g_get_monotonic_time();
+        std::sort(v.begin(), v.end());
+        tSort[m] = g_get_monotonic_time() - t0;
+        for (size_t i = 0; i < v.size(); ++i)
+            keyBytes[m] += v[i].sortKey.size();
+    }
+    for (size_t i = 0; i < entries.size(); ++i)
+        nameBytes += entries[i].dispName.size();
+
+    std::cout << "Sorting " << count << " names (LC_COLLATE=" << setlocale(LC_COLLATE, NULL) << "):" << std::endl;
+    const char *names[] = { "strcoll()", "strxfrm() keys, while listing", "sort by keys",
+        "natural keys, while listing", "sort by natural keys" };
+    gint64 times[] = { tColl, tKeys[0], tSort[0], tKeys[1], tSort[1] };
+    for (int i = 0; i < 5; ++i)
+    {
+        std::cout << "  " << std::left << std::setw(32) << names[i] << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << times[i] / 1000.0 << " ms" << std::endl;
+    }
+    //What the keys add to every entry, besides its names
+    std::cout << "  keys: " << keyBytes[0] / count << " bytes/entry, natural " << keyBytes[1] / count
+        << ", for names of " << nameBytes / count << " bytes" << std::endl;
+
+    //Approximate, the strings up to 15 chars are usually stored inline
+    size_t vectorBytes = entries.capacity() * sizeof(DirEntry);
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const std::string *strs[] = { &entries[i].dispName, &entries[i].fileName, &entries[i].sortKey };
+        for (int n = 0; n < 3; ++n)
+            vectorBytes += strs[n]->capacity() > 15? strs[n]->capacity() + 1 : 0;
+    }
+    EntryList list;
+    t0 = g_get_monotonic_time();
+    for (size_t i = 0; i < entries.size(); ++i)
+        list.push_back(entries[i]);
+    gint64 tList = g_get_monotonic_time() - t0;
+    t0 = g_get_monotonic_time();
+    list.Sort(NULL);
+    gint64 tListSort = g_get_monotonic_time() - t0;
+    std::cout << "Storing " << count << " entries:" << std::endl;
+    std::cout << "  std::vector<DirEntry>: " << vectorBytes / count << " bytes/entry" << std::endl;
+    std::cout << "  EntryList: " << list.Bytes() / count << " bytes/entry, "
+        << std::fixed << std::setprecision(1) << tList / 1000.0 << " ms to fill, "
+        << tListSort / 1000.0 << " ms to sort" << std::endl;
+}
+
+//Checks the AssocMatcher against regexec() and compares their speed
+static void BenchmarkAssocs(int count)
+{
+    std::vector<FileAssoc*> assocs;
+    MakeTestAssocs(assocs);
+    AssocMatcher matcher;
+    matcher.Compile(assocs);
+    std::vector<std::string> names;
+    MakeTestNames(count, names);
+
+    std::vector<FileAssoc*> expected(names.size());
+    gint64 t0 = g_get_monotonic_time();
+    for (size_t i = 0; i < names.size(); ++i)
+        expected[i] = FileAssoc::Match(assocs, names[i].c_str());
+    gint64 tRegex = g_get_monotonic_time() - t0;
+    size_t wrong = 0;
+    t0 = g_get_monotonic_time();
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        if (matcher.Match(names[i].c_str()) != expected[i])
+            ++wrong;
+    }
+    gint64 tMatcher = g_get_monotonic_time() - t0;
+    if (wrong > 0)
+        CheckAssocs(assocs, matcher, names, 1);
+
+    std::cout << "Matching " << names.size() << " names with " << assocs.size() << " associations ("
+        << matcher.Compiled() << " compiled, " << matcher.Extensions() << " extensions, "
+        << matcher.States() << " states):" << std::endl;
+    std::cout << "  " << std::left << std::setw(32) << "regexec() in turn" << std::right
+        << std::fixed << std::setprecision(1) << std::setw(10) << tRegex / 1000.0 << " ms" << std::endl;
+    std::cout << "  " << std::left << std::setw(32) << "AssocMatcher" << std::right
+        << std::fixed << std::setprecision(1) << std::setw(10) << tMatcher / 1000.0 << " ms"
+        << " (" << wrong << " differences)" << std::endl;
+    for (size_t i = 0; i < assocs.size(); ++i)
+        delete assocs[i];
+}
+
+static void BenchmarkRecursive(const std::string &dir, bool canDrop)
+{
+    const int DIRS = 100, FILES = 20, RUNS = 3;
+    std::string path = dir + "/rclauncher-bench-tree";
+    if (!PopulateBenchTree(path, DIRS, FILES))
+    {
+        std::cout << "Cannot create " << path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    FileLister lister(0, "", path);
+    lister.AddAssoc(new FileAssoc("\\.(avi|mkv|mp3)$", REG_EXTENDED | REG_ICASE | REG_NOSUB));
+    lister.PrepareAssocs();
+    lister.SetRecursive(true);
+
+    std::cout << "Recursive listing of " << DIRS * DIRS << " directories, best of " << RUNS << " runs:" << std::endl;
+    for (int cold = 0; cold < 2; ++cold)
+    {
+        if (cold && !canDrop)
+        {
+            std::cout << "  cold: cannot drop the caches, run as root" << std::endl;
+            continue;
+        }
+        size_t count;
+        double ms = TimeListing(lister, RUNS, cold != 0, count);
+        std::cout << "  " << std::left << std::setw(32) << (cold? "cold" : "warm") << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << ms << " ms"
+            << " (" << count << " entries)" << std::endl;
+    }
+}
+
+static int RunBenchmark(const std::string &dir)
+{
+    const int ENTRIES = 100000, RUNS = 5;
+    std::string path = dir + "/rclauncher-bench";
+    if (!PopulateBenchDir(path, ENTRIES))
+    {
+        std::cout << "Cannot create " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    //Measure the actual listing, not the cache
+    g_listCache.SetMaxBytes(0);
+    FileLister lister(0, "", path);
+    lister.AddAssoc(new FileAssoc("\\.(avi|mkv|mp3)$", REG_EXTENDED | REG_ICASE | REG_NOSUB));
+    lister.PrepareAssocs();
+
+    struct Case
+    {
+        const char *name;
+        bool statByPath;
+        bool ignoreDType, ioUring, cold;
+    };
+    static const Case cases[] =
+    {
+        { "readdir, d_type", false, false, false, false },
+        //This is what happens in filesystems without d_type, such as some CIFS or NFS mounts
+        { "readdir + stat(path)", true, true, false, false },
+        { "readdir + fstatat(dirfd)", false, true, false, false },
+#ifdef HAVE_LIBURING
+        { "readdir + io_uring statx", false, true, true, false },
+#endif
+        //With the page, dentry and inode caches dropped before every run
+        { "fstatat, cold", false, true, false, true },
+    };
+
+    bool canDrop = DropCaches();
+    std::cout << "Listing " << path << ", best of " << RUNS << " runs:" << std::endl;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i)
+    {
+        if (cases[i].cold && !canDrop)
+        {
+            std::cout << "  " << cases[i].name << ": cannot drop the caches, run as root" << std::endl;
+            continue;
+        }
+        g_statByPath = cases[i].statByPath;
+        g_ignoreDType = cases[i].ignoreDType;
+        StatBatch::EnableIoUring(cases[i].ioUring);
+        size_t count;
+        double ms = TimeListing(lister, RUNS, cases[i].cold, count);
+        std::cout << "  " << std::left << std::setw(32) << cases[i].name << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << ms << " ms"
+            << " (" << count << " shown of " << ENTRIES << " files)" << std::endl;
+    }
+
+    //The same name transformation, applied while listing or only to the visible rows
+    g_statByPath = false;
+    g_ignoreDType = false;
+    std::cout << "Name transformation:" << std::endl;
+    for (int sort = 1; sort >= 0; --sort)
+    {
+        FileLister transLister(0, "", path);
+        transLister.AddAssoc(new FileAssoc("\\.(avi|mkv|mp3)$", REG_EXTENDED | REG_ICASE | REG_NOSUB));
+        transLister.PrepareAssocs();
+        transLister.AddNameTransform(new NameTrans("^Episode S([0-9]+)E([0-9]+) - ([0-9]+)\\.[a-z0-9]+$", REG_EXTENDED, false, !sort, "\\3 (\\1x\\2)"));
+        size_t count;
+        double msFirst = TimeListing(transLister, 1, false, count);
+        double ms = TimeListing(transLister, RUNS, false, count);
+        if (sort)
+        {
+            std::cout << "  " << std::left << std::setw(32) << "while listing, first time" << std::right
+                << std::fixed << std::setprecision(1) << std::setw(10) << msFirst << " ms"
+                << " (" << count << " shown of " << ENTRIES << " files)" << std::endl;
+        }
+        //A screen full of rows
+        ListSink sink;
+        transLister.ListDir(sink);
+        sink.Flush();
+        gint64 t0 = g_get_monotonic_time();
+        for (size_t i = 0; i < sink.files.size() && i < 30; ++i)
+        {
+            if (!sink.files[i].IsNameReady())
+                sink.files.SetDispName(i, transLister.TransformName(sink.files[i].FileName()));
+        }
+        double msRows = (g_get_monotonic_time() - t0) / 1000.0;
+        std::cout << "  " << std::left << std::setw(32) << (sort? "while listing, memoized" : "on demand, 30 rows") << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << ms + msRows << " ms"
+            << " (" << count << " shown of " << ENTRIES << " files)" << std::endl;
+    }
+
+    //Match() and TransformName() of every entry
+    std::cout << "Classifying the entries (" << g_get_num_processors() << " processors):" << std::endl;
+    for (int parallel = 0; parallel < 2; ++parallel)
+    {
+        if (parallel && g_get_num_processors() < 2)
+        {
+            std::cout << "  in the pool: there is none with a single processor" << std::endl;
+            break;
+        }
+        g_parallelClassify = parallel != 0;
+        size_t count;
+        double ms = 0;
+        for (int i = 0; i < RUNS; ++i)
+        {
+            //A new lister every time, so that the names are not memoized
+            FileLister classLister(0, "", path);
+            classLister.AddAssoc(new FileAssoc("\\.(avi|mkv|mp3)$", REG_EXTENDED | REG_ICASE | REG_NOSUB));
+            classLister.PrepareAssocs();
+            classLister.AddNameTransform(new NameTrans("^Episode S([0-9]+)E([0-9]+) - ([0-9]+)\\.[a-z0-9]+$", REG_EXTENDED, false, false, "\\3 (\\1x\\2)"));
+            double t = TimeListing(classLister, 1, false, count);
+            if (i == 0 || t < ms)
+                ms = t;
+        }
+        std::cout << "  " << std::left << std::setw(32) << (parallel? "in the pool" : "in the listing thread") << std::right
+            << std::fixed << std::setprecision(1) << std::setw(10) << ms << " ms"
+            << " (" << count << " shown of " << ENTRIES << " files)" << std::endl;
+    }
+    g_parallelClassify = true;
+
+    //The collation keys of the UTF-8 locales are much longer than the names
+    static const char *locales[] = { "C", "C.UTF-8", "en_US.UTF-8" };
+    std::string oldLocale = setlocale(LC_COLLATE, NULL);
+    for (size_t i = 0; i < sizeof(locales) / sizeof(*locales); ++i)
+    {
+        if (setlocale(LC_COLLATE, locales[i]))
+            BenchmarkSort(ENTRIES);
+        else
+            std::cout << "Sorting: the locale " << locales[i] << " is not available" << std::endl;
+    }
+    setlocale(LC_COLLATE, oldLocale.c_str());
+    BenchmarkAssocs(ENTRIES);
+    BenchmarkRecursive(dir, canDrop);
+    return 0;
+}
+#endif
+
+#ifdef RCLAUNCHER_TEST
+//Random associations, made of the pieces that the AssocMatcher understands and a few that it
+//does not, checked with random names made of characters that they match or almost
+static size_t FuzzAssocs(int rounds)
+{
+    static const char *atoms[] =
+    {
+        "a", "b", "A", ".", "[ab]", "[^a]", "[a-c]", "(a|b)", "(ab|a)", "x", "é", "\\.", "^", "$", "()",
+        "(a|)", "[]a]", "[^]b]", "-", "[a-]", "[[:alpha:]]",
+    };
+    static const char *quants[] = { "", "", "", "*", "+", "?", "{2}", "{1,3}", "{2,}", "{0,1}" };
+    static const char *chars[] = { "a", "b", "A", "B", "x", ".", "é", "É", "Ñ", "\xff", "-", "]", "c", "ab" };
+    const int nAtoms = sizeof(atoms) / sizeof(*atoms);
+    const int nQuants = sizeof(quants) / sizeof(*quants);
+    const int nChars = sizeof(chars) / sizeof(*chars);
+
+    size_t wrong = 0;
+    for (int round = 0; round < rounds; ++round)
+    {
+        std::vector<FileAssoc*> assocs;
+        for (int n = 1 + rand() % 6; n > 0; --n)
+        {
+            std::string regex;
+            for (int k = 1 + rand() % 4; k > 0; --k)
+            {
+                regex += atoms[rand() % nAtoms];
+                regex += quants[rand() % nQuants];
+                if (rand() % 8 == 0)
+                    regex += "|";
+            }
+            int cflags = REG_EXTENDED | REG_NOSUB | (rand() % 2? REG_ICASE : 0);
+            try
+            {
+                assocs.push_back(new FileAssoc(regex.c_str(), cflags));
+            }
+            catch (std::exception &)
+            {
+                //Not a valid regex, regcomp() says so
+            }
+        }
+        AssocMatcher matcher;
+        matcher.Compile(assocs);
+        std::vector<std::string> names;
+        for (int n = 0; n < 200; ++n)
+        {
+            std::string name;
+            for (int k = rand() % 7; k > 0; --k)
+                name += chars[rand() % nChars];
+            names.push_back(name);
+        }
+        size_t w = CheckAssocs(assocs, matcher, names, wrong < 10? 1 : 0);
+        if (w > 0 && wrong < 10)
+        {
+            std::cout << "  in the associations:";
+            for (size_t i = 0; i < assocs.size(); ++i)
+                std::cout << " '" << assocs[i]->pattern << "'";
+            std::cout << std::endl;
+        }
+        wrong += w;
+        for (size_t i = 0; i < assocs.size(); ++i)
+            delete assocs[i];
+    }
+    return wrong;
+}
+
+//The differential test of the AssocMatcher against regexec(), for make check.
+//It fails if they match any name differently.
+static int RunAssocTest()
+{
+    static const char *locales[] = { "C", "C.UTF-8", "en_US.UTF-8" };
+    size_t wrong = 0;
+    for (size_t i = 0; i < sizeof(locales) / sizeof(*locales); ++i)
+    {
+        if (!setlocale(LC_ALL, locales[i]))
+        {
+            std::cout << "Locale " << locales[i] << ": not available" << std::endl;
+            continue;
+        }
+        std::vector<FileAssoc*> assocs;
+        MakeTestAssocs(assocs);
+        AssocMatcher matcher;
+        matcher.Compile(assocs);
+        std::vector<std::string> names;
+        MakeTestNames(10000, names);
+        size_t fixed = CheckAssocs(assocs, matcher, names, 10);
+        for (size_t n = 0; n < assocs.size(); ++n)
+            delete assocs[n];
+
+        srand(7);
+        size_t fuzz = FuzzAssocs(3000);
+        std::cout << "Locale " << locales[i] << ": " << fixed << " differences in " << names.size()
+            << " names, " << fuzz << " in the random associations" << std::endl;
+        wrong += fixed + fuzz;
+    }
+    return wrong == 0? 0 : 1;
+}
+#endif
+
 int main(int argc, char **argv)
 {
+#ifdef RCLAUNCHER_TEST
+    return RunAssocTest();
+#endif
     try
     {
-        gtk_init(&argc, &argv);
+        //The display is not opened yet, so that the benchmark can run without it
+        gtk_parse_args(&argc, &argv);
 
         const char *home = getenv("HOME");
         if (!home)
@@ -1720,11 +7869,17 @@ int main(int argc, char **argv)
 
         std::string configFile = std::string(home) +  "/.rclauncher";
         std::string lircFile;
+#ifdef RCLAUNCHER_BENCHMARK
+        std::string benchDir;
+#endif
 
         int op;
         struct option longopts[] =
         {
             {"geometry", required_argument, NULL, 'g'},
+#ifdef RCLAUNCHER_BENCHMARK
+            {"benchmark", required_argument, NULL, 'B'},
+#endif
             {NULL}
         };
         while ((op = getopt_long_only(argc, argv, "hc:l:vfd", longopts, NULL)) != -1)
@@ -1753,14 +7908,36 @@ int main(int argc, char **argv)
             case 'g':
                 g_geometry = optarg;
                 break;
+#ifdef RCLAUNCHER_BENCHMARK
+            case 'B':
+                benchDir = optarg;
+                break;
+#endif
             }
         }
 
-        RCParser().ParseFile(configFile);
+#ifdef RCLAUNCHER_BENCHMARK
+        if (!benchDir.empty())
+            return RunBenchmark(benchDir);
+#endif
+
+        gtk_init(&argc, &argv);
 
-        MainWnd mainWnd(lircFile);
+        RCParser().ParseFile(configFile);
+        g_defaultLister.PrepareAssocs();
+        for (size_t i = 0; i < g_options.favorites.size(); ++i)
+            g_options.favorites[i]->PrepareAssocs();
 
-        gtk_main();
+        {
+            MainWnd mainWnd(lircFile);
+            gtk_main();
+        }
+        //A listing stuck in a dead mount would use the globals after they are destroyed
+        if (ListJob::AnyDetached() || Prefetcher::AnyDetached())
+        {
+            std::cout.flush();
+            _exit(0);
+        }
         return 0;
     }
     catch (std::exception &e)